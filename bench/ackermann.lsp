@@ -0,0 +1,10 @@
+; Ackermann's function: deep recursion (as deep as the heap allows).
+; expect: 125
+(label ack (lambda (m n)
+  (cond ((eq m 0) (+ n 1))
+        ((eq n 0) (ack (- m 1) 1))
+        (t (ack (- m 1) (ack m (- n 1)))))))
+(label run (lambda (n)
+  (cond ((eq n 0) (ack 3 4))
+        (t ((lambda (r) (run (- n 1))) (ack 3 4))))))
+(run 20)
@@ -0,0 +1,18 @@
+; Association list lookups, in Lisp and (for every variable) in the
+; interpreter itself.
+; expect: 14762000
+(label build (lambda (n acc)
+  (cond ((eq n 0) acc)
+        (t (build (- n 1) (cons (cons n (* n n)) acc))))))
+(label table (build 60 (quote ())))
+(label find (lambda (k alist)
+  (cond ((null alist) (quote ()))
+        ((eq (car (car alist)) k) (cdr (car alist)))
+        (t (find k (cdr alist))))))
+(label sum (lambda (k acc)
+  (cond ((eq k 0) acc)
+        (t (sum (- k 1) (+ acc (find k table)))))))
+(label run (lambda (n acc)
+  (cond ((eq n 0) acc)
+        (t (run (- n 1) (+ acc (sum 60 0)))))))
+(run 200 0)
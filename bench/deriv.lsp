@@ -0,0 +1,22 @@
+; Symbolic differentiation: allocation-heavy tree building.
+; expect: (+ (+ (* 3 (+ (* X 1) (* 1 X))) (* 0 (* X X))) (+ 1 0))
+(label deriv (lambda (e)
+  (cond ((atom e) (cond ((eq e (quote x)) 1) (t 0)))
+        ((eq (car e) (quote +))
+         (cons (quote +)
+               (cons (deriv (car (cdr e)))
+                     (cons (deriv (car (cdr (cdr e)))) (quote ())))))
+        (t
+         (cons (quote +)
+               (cons (cons (quote *)
+                           (cons (car (cdr e))
+                                 (cons (deriv (car (cdr (cdr e)))) (quote ()))))
+                     (cons (cons (quote *)
+                                 (cons (deriv (car (cdr e)))
+                                       (cons (car (cdr (cdr e))) (quote ()))))
+                           (quote ()))))))))
+(label expr (quote (+ (* 3 (* x x)) (+ x 5))))
+(label run (lambda (n)
+  (cond ((eq n 0) (deriv expr))
+        (t ((lambda (d) (run (- n 1))) (deriv expr))))))
+(run 10000)
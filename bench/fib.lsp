@@ -0,0 +1,6 @@
+; Doubly recursive Fibonacci: function call overhead and arithmetic.
+; expect: 75025
+(label fib (lambda (n)
+  (cond ((< n 2) n)
+        (t (+ (fib (- n 1)) (fib (- n 2)))))))
+(fib 25)
@@ -0,0 +1,16 @@
+; List reversal and (non-tail recursive) append.
+; expect: 100
+(label iota (lambda (n acc)
+  (cond ((eq n 0) acc)
+        (t (iota (- n 1) (cons n acc))))))
+(label append (lambda (a b)
+  (cond ((null a) b)
+        (t (cons (car a) (append (cdr a) b))))))
+(label rev (lambda (l acc)
+  (cond ((null l) acc)
+        (t (rev (cdr l) (cons (car l) acc))))))
+(label numbers (iota 100 (quote ())))
+(label run (lambda (n)
+  (cond ((eq n 0) (car (rev (append numbers numbers) (quote ()))))
+        (t ((lambda (r) (run (- n 1))) (rev (append numbers numbers) (quote ())))))))
+(run 1000)
@@ -0,0 +1,7 @@
+; A tail-recursive loop far deeper than the call depth limit: tail calls
+; must run in constant stack, interpreted or compiled.
+; expect: 5000050000
+(label loop (lambda (n acc)
+  (cond ((eq n 0) acc)
+        (t (loop (- n 1) (+ acc n))))))
+(loop 100000 0)
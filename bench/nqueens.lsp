@@ -0,0 +1,16 @@
+; Counts the solutions to the N-queens problem: list building and COND.
+; expect: 92
+(label safe (lambda (col dist placed)
+  (cond ((null placed) t)
+        ((eq (car placed) col) (quote ()))
+        ((eq (car placed) (+ col dist)) (quote ()))
+        ((eq (car placed) (- col dist)) (quote ()))
+        (t (safe col (+ dist 1) (cdr placed))))))
+(label try (lambda (n row placed col)
+  (cond ((eq row n) 1)
+        ((eq col n) 0)
+        ((safe col 1 placed)
+         (+ (try n (+ row 1) (cons col placed) 0)
+            (try n row placed (+ col 1))))
+        (t (try n row placed (+ col 1))))))
+(try 8 0 (quote ()) 0)
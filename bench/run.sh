@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Runs every benchmark in this directory and prints one JSON object per
+# line: the statistics `lersp -s` reports, plus the benchmark's name and
+# whether its final result matched the "; expect:" line in the file --
+# and, if given, a name for the build.
+#
+# Usage: bench/run.sh [path/to/lersp [build]]
+
+LERSP=${1:-./lersp}
+BUILD=${2:+\"build\": \"$2\", }
+BENCH_DIR=$(dirname "$0")
+OUTPUT=$(mktemp)
+STATS=$(mktemp)
+STATUS=0
+
+for program in "$BENCH_DIR"/*.lsp; do
+    name=$(basename "$program" .lsp)
+    expected=$(sed -n 's/^; expect: //p' "$program")
+
+    "$LERSP" -s < "$program" > "$OUTPUT" 2> "$STATS"
+    stats=$(tail -n 1 "$STATS")
+    # stdout ends with the last result, then a bare prompt.
+    result=$(tail -n 2 "$OUTPUT" | head -n 1 | sed 's/^;=> //')
+
+    if [ "$result" = "$expected" ]; then
+        ok=true
+    else
+        ok=false
+        STATUS=1
+    fi
+
+    echo "{\"benchmark\": \"$name\", $BUILD\"ok\": $ok, ${stats#\{}"
+done
+
+rm -f "$OUTPUT" "$STATS"
+exit $STATUS
@@ -0,0 +1,8 @@
+; Takeuchi's function: deep, non-tail recursion with three arguments.
+; expect: 9
+(label tak (lambda (x y z)
+  (cond ((not (< y x)) z)
+        (t (tak (tak (- x 1) y z)
+                (tak (- y 1) z x)
+                (tak (- z 1) x y))))))
+(tak 22 16 8)
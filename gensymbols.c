@@ -0,0 +1,76 @@
+/*
+ * Writes symbols.h: a perfect hash from the names in symbols.def to their
+ * ids, so that looking up an initial symbol by name is one probe.
+ *
+ *      gensymbols > symbols.h
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Compiled in here, and written out verbatim for lersp.c. */
+#define NAME_HASH \
+    static uint32_t name_hash(const char *name, uint32_t seed) { \
+        uint32_t hash = seed; \
+        while (*name != '\0') { \
+            hash = (hash ^ (unsigned char) *name++) * 16777619u; \
+        } \
+        return hash ^ (hash >> 15); \
+    }
+
+#define STRINGIFY(...)  #__VA_ARGS__
+#define SOURCE_OF(macro)    STRINGIFY(macro)
+
+NAME_HASH
+
+static const char *NAMES[] = {
+#define SYMBOL(id, name) name,
+#include "symbols.def"
+};
+#define NAME_COUNT  (sizeof(NAMES) / sizeof(NAMES[0]))
+
+int main(void) {
+    size_t size, i;
+    uint32_t seed, mask;
+    int slots[1024];
+
+    /* The smallest power of two with room to spare that some seed fits. */
+    for (size = 2 * NAME_COUNT; (size & (size - 1)) != 0; size++)
+        ;
+    for (; size <= sizeof(slots) / sizeof(slots[0]); size *= 2) {
+        mask = size - 1;
+        for (seed = 2166136261u; seed < 2166136261u + 100000; seed++) {
+            for (i = 0; i < size; i++) {
+                slots[i] = -1;
+            }
+            for (i = 0; i < NAME_COUNT; i++) {
+                uint32_t slot = name_hash(NAMES[i], seed) & mask;
+                if (slots[slot] != -1) {
+                    break;
+                }
+                slots[slot] = i;
+            }
+            if (i == NAME_COUNT) {
+                goto found;
+            }
+        }
+    }
+    fprintf(stderr, "gensymbols: no perfect hash for %zu names.\n", NAME_COUNT);
+    return 1;
+
+found:
+    printf("/* Generated by gensymbols from symbols.def. Do not edit. */\n\n");
+    printf("#define SYMBOL_HASH_SEED    %uu\n", seed);
+    printf("#define SYMBOL_HASH_MASK    %u\n\n", mask);
+    printf("%s\n\n", SOURCE_OF(NAME_HASH));
+    printf("/* By name_hash(name, SYMBOL_HASH_SEED) & SYMBOL_HASH_MASK: an id, or -1. */\n");
+    printf("static const short SYMBOL_HASH_SLOTS[%zu] = {", size);
+    for (i = 0; i < size; i++) {
+        printf("%s%d,", (i % 12 == 0) ? "\n    " : " ", slots[i]);
+    }
+    printf("\n};\n");
+
+    return 0;
+}
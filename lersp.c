@@ -7,6 +7,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <float.h>
 
 #include <assert.h>
 
@@ -14,9 +18,39 @@
 #include <ctype.h>
 
 #include <setjmp.h> // Oh... Oh nooooooo.
+#include <ucontext.h> // It gets worse.
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+/* Compile hot numeric lambdas to native code; see jit_call(). Build with
+ * -DJIT=0 to leave it out. */
+#ifndef JIT
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT 1
+#else
+#define JIT 0
+#endif
+#endif
 
 
 #include "lersp.h"
+#include "symbols.h"
 
 static char INTRO_BANNER[] =
     "; Lersp\n"
@@ -25,6 +59,8 @@ static char INTRO_BANNER[] =
 
 /* Points to the next free cell in the free list. */
 static sexpr *next_free_cell;
+/* How many cells are on the free list. */
+static int free_cell_count = 0;
 sexpr heap[HEAP_SIZE];
 
 /* Internal nil; having this explict makes the GC algorithm more elegant. */
@@ -37,38 +73,358 @@ static sexpr nil = {
 
 sexpr *const NIL = &nil;
 
+/* The one and only end-of-file object. */
+static sexpr eof = {
+    .type = END_OF_FILE,
+    .reached = 0,
+};
+
+sexpr *const EOF_OBJECT = &eof;
+
 /* Points to the cell where the universe starts.  */
 static sexpr *global = &nil; // execution context?
 
 /* List of (identifier . name) pairs. */
 static sexpr *name_list = &nil;
+/* The same names, and identifiers, indexed by identifier. */
+static char *symbol_names[MAX_NAMES];
+static sexpr *symbol_cells[MAX_NAMES];
 /* Amount of symbols left to use. */
 static int next_symbol_id = 0;
 
+/* Their names, by id; see symbols.def. */
+static const char *INITIAL_SYMBOLS[] = {
+#define SYMBOL(id, name) name,
+#include "symbols.def"
+};
+
 /* setjmp read/eval exception buffer. */
 sigjmp_buf top_level_exception;
 
+/* Where the C stack starts; everything above the collector's frame up to
+ * here is scanned for pointers into the heap. */
+void *gc_stack_bottom = NULL;
+
+/* Buckets in the free-list exhaustion histogram: bucket i counts the
+ * times the free list ran dry after [2^i, 2^(i+1)) allocations. */
+#define HISTOGRAM_BUCKETS   32
+
+/* Running totals, reported with -s and by GC-STATS. */
+static struct {
+    unsigned long evaluations;
+    unsigned long cells_allocated;
+    unsigned long collections;
+    unsigned long cells_freed;
+    unsigned long live_cells; /* As of the last collection. */
+    double pause_total; /* Seconds. */
+    double pause_max;
+    unsigned long exhaustions;
+    unsigned long exhaustion_histogram[HISTOGRAM_BUCKETS];
+} stats;
+
+/* stats.cells_allocated when the free list last ran dry. */
+static unsigned long allocated_at_exhaustion = 0;
+
+/*
+ * Budgets for each top-level evaluation (-f, -m, -r); zero means no limit.
+ * Going over one abandons the evaluation with LIMIT_EXCEEDED. The default
+ * depth keeps deep recursion from overflowing the C stack.
+ */
+static unsigned long fuel_limit = 0, cell_limit = 0;
+static int depth_limit = 10000;
+/* The values of stats.evaluations and stats.cells_allocated at which the
+ * current evaluation runs out. */
+static unsigned long fuel_deadline = ULONG_MAX, cell_deadline = ULONG_MAX;
+
+/* When main() started. */
+static struct timespec start_time;
+
+/*
+ * The Lisp-level call stack: the name of every function being applied,
+ * outermost first. Tail calls replace their caller's entry. Frames past
+ * MAX_CALL_DEPTH are counted but not recorded.
+ */
+#define MAX_CALL_DEPTH  4096
+static volatile l_symbol call_stack[MAX_CALL_DEPTH];
+static volatile int call_depth = 0;
+
+/* The LABEL each closure was bound to (plus one; zero if none), so that
+ * it can be named no matter how it's called. */
+static l_symbol closure_names[HEAP_SIZE];
+
+/* The C function `lersp --compile` made of each closure, if any. */
+static l_builtin compiled_closures[HEAP_SIZE];
+
+/* What create_lambda() works out about a lambda expression; see
+ * free_symbols_of(). Indexed by the body's cell. */
+typedef double (*native_entry)(double, double, double, double,
+        double, double, double, double);
+
+struct free_symbols {
+    sexpr *formals;
+    sexpr *optimized; /* The body, partially evaluated; NULL if not yet. */
+    unsigned long epoch; /* The optimization_epoch it was made in. */
+    struct {
+        unsigned long calls; /* Interpreted, since compiling was last tried. */
+        unsigned long epoch; /* The optimization_epoch that was in. */
+        native_entry entry; /* NULL if it couldn't be compiled. */
+        l_symbol name; /* What it calls itself, if recursive. */
+        int arity;
+        bool recursive;
+    } jit;
+    size_t count;
+    l_symbol symbols[];
+};
+static struct free_symbols *free_symbol_cache[HEAP_SIZE];
+
+/* Bumped whenever LABEL rebinds an initial symbol, which throws out every
+ * optimized body; see partially_evaluate(). */
+static unsigned long optimization_epoch = 1;
+static bool redefined[MAX_NAMES];
+
+#define IS_HEAP_CELL(cell)  (((cell) >= heap) && ((cell) < heap + HEAP_SIZE))
+
+/*
+ * Hash-consing (-u). Atoms the reader makes, quoted data and whatever READ
+ * returns are looked up before they're kept, so equal ones are one cell.
+ * The table is weak: the collector drops cells nothing else holds.
+ */
+static bool hash_consing = false;
+static bool shared[HEAP_SIZE];
+static uint32_t shared_buckets[HEAP_SIZE]; /* Index + 1 of a chain's first cell, or 0. */
+static uint32_t shared_next[HEAP_SIZE];
+
+/* Shared cells stand for every equal expression, so they're never
+ * rewritten in place. */
+#define is_shared(cell) \
+    (((cell) >= heap) && ((cell) < heap + HEAP_SIZE) && shared[(cell) - heap])
+
+/*
+ * Allocation-site profiling (-a). Cells are charged to whatever is on top
+ * of the call stack when they're allocated: a function, a special form,
+ * or READ; SITE_TOPLEVEL stands for an empty stack.
+ */
+#define SITE_TOPLEVEL   MAX_NAMES
+static FILE *allocation_report = NULL;
+static l_symbol cell_sites[HEAP_SIZE];
+static unsigned long site_allocated[MAX_NAMES + 1]; /* Since the last GC. */
+static unsigned long site_retained[MAX_NAMES + 1]; /* By the last GC. */
+
+/*
+ * Phase timing (-t, and TIME). Whatever the interpreter is doing is
+ * charged to exactly one phase at a time.
+ */
+enum phase { PHASE_READ, PHASE_EVAL, PHASE_PRINT, PHASE_GC, PHASES };
+static int current_phase = PHASE_EVAL;
+/* Whether phases are being timed right now; and whether -t asked for it. */
+static bool timing = false;
+static bool timing_requested = false;
+
+/* Values that must never be collected; see keep(). */
+static sexpr *kept = &nil;
+
+/* Command line arguments; OPEN-INPUT can open them by index. */
+static int file_argc = 0;
+static char **file_argv = NULL;
+
+
+static void out_char(char c);
+static void out_str(const char *text);
+static void out_printf(const char *format, ...);
+static bool start_profiler(const char *path);
+static void push_call(l_symbol name);
+static void exceed_budget(const char *message) __attribute__((noreturn));
+static void start_budgets(void);
+static void end_budgets(void);
+static void start_allocation_report(void);
+static void compact_strings(void);
+static void start_timing(void);
+static void switch_phase(int phase);
+static void report_expression_timing(void);
+static sexpr* time_evaluation(sexpr *expr, sexpr *env);
+static sexpr* jit_call(sexpr *func, sexpr *args);
+static void start_pipeline(void);
+static bool hand_off_output(bool wait);
+static void rehash_shared(void);
+
+
+static char USAGE[] =
+    "Usage: %s [-s] [-t] [-u] [-b] [-p profile] [-a report] [-f fuel]\n"
+    "       [-m cells] [-r depth] [-i image] [-d image] [file...]\n"
+    "  -s         print statistics as JSON on stderr at exit\n"
+    "  -p profile sample the call stack and write collapsed stacks there\n"
+    "  -a report  after each GC, write cells allocated and retained per site\n"
+    "  -t         time reading, evaluation, printing and GC of each expression\n"
+    "  -f fuel    limit each expression to this many evaluation steps\n"
+    "  -m cells   limit each expression to allocating this many cells\n"
+    "  -r depth   limit calls to this depth (default 10000)\n"
+    "  -i image   start from a heap image instead of from scratch\n"
+    "  -d image   dump a heap image once stdin runs out\n"
+    "  -u         share equal atoms, quoted data and data READ returns\n"
+    "  -b         batch: tokenize stdin and write stdout on threads of their own\n"
+    "  --compile prog.lsp [-o prog.c]\n"
+    "             translate a program to C instead of running anything\n";
+
+static double seconds_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* One line of JSON, so benchmark drivers don't have to parse anything. */
+static void print_statistics(void) {
+    double seconds = seconds_since(&start_time);
+    int i, buckets = HISTOGRAM_BUCKETS;
+
+    fprintf(stderr,
+            "{\"seconds\": %.6f, \"evaluations\": %lu, "
+            "\"evaluations_per_second\": %.0f, \"cells_allocated\": %lu, "
+            "\"collections\": %lu, \"cells_freed\": %lu, "
+            "\"live_cells\": %lu, \"heap_size\": %d, "
+            "\"gc_pause_total_seconds\": %.6f, "
+            "\"gc_pause_max_seconds\": %.6f, "
+            "\"free_list_exhaustions\": %lu, \"exhaustion_histogram\": [",
+            seconds, stats.evaluations,
+            (seconds > 0) ? stats.evaluations / seconds : 0.0,
+            stats.cells_allocated, stats.collections, stats.cells_freed,
+            stats.live_cells, HEAP_SIZE, stats.pause_total, stats.pause_max,
+            stats.exhaustions);
+
+    while ((buckets > 0) && (stats.exhaustion_histogram[buckets - 1] == 0)) {
+        buckets--;
+    }
+    for (i = 0; i < buckets; i++) {
+        fprintf(stderr, "%s%lu", (i > 0) ? ", " : "",
+                stats.exhaustion_histogram[i]);
+    }
+
+    fprintf(stderr, "]}\n");
+}
+
+static bool compile_program(const char *source, const char *output);
+
+#ifndef LERSP_NO_MAIN
+
+static const struct option LONG_OPTIONS[] = {
+    { "compile", required_argument, NULL, 'c' },
+    { NULL, 0, NULL, 0 }
+};
 
 /*
  * A lisp interpreter, I guess.
  */
 int main(int argc, char *argv[]) {
-    init();
+    char *image_in = NULL, *image_out = NULL, *profile = NULL;
+    char *source = NULL, *output = NULL;
+    bool pipelined = false;
+    int option;
+
+    gc_stack_bottom = __builtin_frame_address(0);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    while ((option = getopt_long(argc, argv, "sp:a:tf:m:r:i:d:ubc:o:",
+                    LONG_OPTIONS, NULL)) != -1) {
+        switch (option) {
+            case 's':
+                atexit(print_statistics);
+                break;
+            case 'p':
+                profile = optarg;
+                break;
+            case 't':
+                timing_requested = true;
+                break;
+            case 'f':
+                fuel_limit = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                cell_limit = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                depth_limit = atoi(optarg);
+                break;
+            case 'a':
+                allocation_report = fopen(optarg, "w");
+                if (allocation_report == NULL) {
+                    fprintf(stderr, "Could not open %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'i':
+                image_in = optarg;
+                break;
+            case 'd':
+                image_out = optarg;
+                break;
+            case 'u':
+                hash_consing = true;
+                break;
+            case 'b':
+                pipelined = true;
+                break;
+            case 'c':
+                source = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                fprintf(stderr, USAGE, argv[0]);
+                return 2;
+        }
+    }
+
+    if (image_in == NULL) {
+        init();
+    } else if (!load_image(image_in)) {
+        fprintf(stderr, "Could not load image %s\n", image_in);
+        return 2;
+    }
+
+    if (source != NULL) {
+        return compile_program(source, output) ? 0 : 1;
+    }
+
+    if (allocation_report != NULL) {
+        start_allocation_report();
+    }
+
+    /* Any other arguments are data files: the program itself comes from
+     * stdin and can get at them with (OPEN-INPUT n). */
+    file_argc = argc - optind + 1;
+    file_argv = argv + optind - 1;
+
+    /* Options alone don't change that this is a fresh session. */
+    if ((image_in == NULL) && (file_argc == 1)) {
+        out_str(INTRO_BANNER);
+        out_char('\n');
+    }
 
-    if (argc < 2) {
-        puts(INTRO_BANNER);
-        repl();
+    if ((profile != NULL) && !start_profiler(profile)) {
+        fprintf(stderr, "Could not start the profiler.\n");
+        return 2;
     }
 
+    if (pipelined) {
+        start_pipeline();
+    }
+
+    repl();
+
 #if VERBOSE_DEBUG
     print(name_list);
 #endif
 
-    /* TODO: I guess, interpret a file or something. */
+    if ((image_out != NULL) && !dump_image(image_out)) {
+        fprintf(stderr, "Could not dump image %s\n", image_out);
+        return 2;
+    }
 
     return 0;
 }
 
+#endif /* LERSP_NO_MAIN */
+
 
 
 void repl(void) {
@@ -77,11 +433,24 @@ void repl(void) {
     sexpr *input;
     sexpr *evaluation;
 
+    bool interactive = isatty(STDIN_FILENO);
+
     while (1) {
-        printf(";=> ");
+        out_str(";=> ");
+        if (interactive) {
+            flush_output();
+        }
 
         parse_status = setjmp(top_level_exception);
         if (parse_status == NOT_PARSED) {
+            end_budgets();
+            if (timing_requested) {
+                start_timing();
+                switch_phase(PHASE_READ);
+            }
+            /* Attribute reading to the reader. */
+            call_depth = 0;
+            push_call(READ);
             input = l_read();
         } else if (parse_status == END_INPUT) {
             break;
@@ -89,12 +458,32 @@ void repl(void) {
             /* Most useful error message ever. */
             fprintf(stderr, "Syntax error.\n");
             continue;
+        } else if (parse_status == LIMIT_EXCEEDED) {
+            /* The heap filled up mid-expression. */
+            fprintf(stderr, "Read error.\n");
+            continue;
+        }
+
+        if (input == EOF_OBJECT) {
+            break;
         }
 
         eval_status = setjmp(top_level_exception);
+        /* An error may have unwound any number of calls -- and TIMEs. */
+        call_depth = 0;
+        timing = timing_requested;
         if (eval_status == NOT_EVALUATED) {
+            start_budgets();
+            switch_phase(PHASE_EVAL);
             evaluation = eval(input, global);
+            switch_phase(PHASE_PRINT);
             print(evaluation);
+            if (timing) {
+                report_expression_timing();
+            }
+        } else if (eval_status == SYNTAX_ERROR) {
+            /* Raised by READ. */
+            fprintf(stderr, "Syntax error.\n");
         } else {
             /* Wow. There is no way to be any more vague. */
             fprintf(stderr, "Evaluation error.\n");
@@ -105,71 +494,324 @@ void repl(void) {
 
 
 
-void display_list(sexpr *head) {
-    sexpr *current = head;
-    assert(head->type == CONS);
+/*
+ * Output.
+ *
+ * Everything bound for stdout is gathered here and written out in large
+ * blocks, rather than paying for stdio's locking and format parsing on
+ * every token.
+ */
 
-    printf("(");
-    do {
-        display(current->car);
-        if (current->cdr != NIL) {
-            printf(" ");
-        }
+#define OUTPUT_BUFFER_SIZE  (64 * 1024)
 
-        current = current->cdr;
-    } while ((current != NIL) && (current->type == CONS));
+/* Two, so that one can be filled while the writer thread (-b) writes the
+ * other out. */
+static char output_buffers[2][OUTPUT_BUFFER_SIZE];
+static char *output_buffer = output_buffers[0];
+static size_t output_length = 0;
 
-    if (current != NIL) {
-        /* This must be the end of an improper list. */
-        printf(". ");
-        display(current);
+/* Writes out the buffer; unless wait is set, the writer thread may still
+ * be at it on return. */
+static void drain_output(bool wait) {
+    if (!hand_off_output(wait)) {
+        fwrite(output_buffer, 1, output_length, stdout);
+        fflush(stdout);
     }
+    output_length = 0;
+}
 
-    printf(")");
+void flush_output(void) {
+    drain_output(true);
 }
 
-void display(sexpr* expr) {
-    if (expr == NIL) {
-        printf("NIL");
-        return;
+static void out_write(const char *text, size_t length) {
+    size_t part;
+
+    while (output_length + length > OUTPUT_BUFFER_SIZE) {
+        part = OUTPUT_BUFFER_SIZE - output_length;
+        memcpy(output_buffer + output_length, text, part);
+        output_length += part;
+        drain_output(false);
+        text += part;
+        length -= part;
+    }
+
+    memcpy(output_buffer + output_length, text, length);
+    output_length += length;
+}
+
+static void out_char(char c) {
+    if (output_length == OUTPUT_BUFFER_SIZE) {
+        drain_output(false);
+    }
+    output_buffer[output_length++] = c;
+}
+
+static void out_str(const char *text) {
+    out_write(text, strlen(text));
+}
+
+/* Only for the odd bit of debug output; display() doesn't use it. */
+static void out_printf(const char *format, ...) {
+    char text[256];
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    if (length > 0) {
+        out_write(text, ((size_t) length < sizeof(text))
+                ? (size_t) length : sizeof(text) - 1);
+    }
+}
+
+/* Longest possible output of format_number(). */
+#define NUMBER_LENGTH   32
+
+/*
+ * Writes the shortest decimal representation of the number that reads back
+ * as exactly the same double. Integers (by far the most common) skip
+ * snprintf altogether; everything else tries increasing precisions until
+ * one round-trips -- anything with a 15 digit representation (almost
+ * everything typed in) gets it on the first try.
+ */
+static size_t format_number(l_number number, char *text) {
+    char digits[NUMBER_LENGTH];
+    size_t length = 0, i = 0;
+    int precision;
+
+    if ((number == (long long) number) && (number < 1e15) && (number > -1e15)) {
+        long long integer = (long long) number;
+        unsigned long long magnitude;
+
+        if (signbit(number)) {
+            text[length++] = '-';
+        }
+        magnitude = (integer < 0) ? -(unsigned long long) integer : integer;
+
+        do {
+            digits[i++] = '0' + (magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude > 0);
+
+        while (i > 0) {
+            text[length++] = digits[--i];
+        }
+        text[length] = '\0';
+
+        return length;
+    }
+
+    for (precision = 15; precision < 17; precision++) {
+        snprintf(text, NUMBER_LENGTH, "%.*g", precision, number);
+        if (strtod(text, NULL) == number) {
+            return strlen(text);
+        }
     }
 
+    return snprintf(text, NUMBER_LENGTH, "%.17g", number);
+}
+
+static void display_string(sexpr *string);
+
+static void display_atom(sexpr *expr) {
+    char text[NUMBER_LENGTH];
+
     switch (expr->type) {
         case NUMBER:
-            printf("%g", expr->number);
+            out_write(text, format_number(expr->number, text));
             break;
 
         case SYMBOL:
-            printf("%s", lookup(expr->symbol));
+            out_str(lookup(expr->symbol));
             break;
 
-        case FUNCTION:
-            /* A function is just a cons-cell. */
-            printf("#<LAMBDA ");
-            display(expr->car);
-            printf(">");
-            break;
-        case CONS:
-            display_list(expr);
-            break;
         case WORD:
             /* DEBUG! `word` type is internal and not representable in program
              * text. */
-            printf("\033[1;33;44m#<WORD %s>\033[0m", expr->word);
+            out_str("\033[1;33;44m#<WORD ");
+            out_str(expr->word);
+            out_str(">\033[0m");
             break;
         case BUILT_IN_FUNCTION:
-            printf("\033[1;33;44m#<BIF %p>\033[0m", expr->func);
+            out_printf("\033[1;33;44m#<BIF %p>\033[0m", expr->func);
+            break;
+        case END_OF_FILE:
+            out_str("#EOF");
+            break;
+        case PORT:
+            out_printf("#<PORT %p>", expr->stream);
+            break;
+        case HASH_TABLE:
+            out_printf("#<HASH %zu>", expr->table->count);
+            break;
+        case VECTOR:
+            /* Only the empty vector; display() opens the others. */
+            out_str("#()");
+            break;
+        case CHANNEL:
+            out_printf("#<CHANNEL %zu>", expr->channel->count);
+            break;
+        case STRING:
+            display_string(expr);
+            break;
+        case F64_ARRAY:
+            out_str("#F64(");
+            for (size_t i = 0; i < expr->f64->length; i++) {
+                if (i > 0) {
+                    out_char(' ');
+                }
+                out_write(text, format_number(expr->f64->items[i], text));
+            }
+            out_char(')');
             break;
         default:
             assert(0);
     }
 }
 
+/* A list (or lambda) that has been opened but not yet closed. */
+struct display_frame {
+    sexpr *head;    /* First cell; NULL once only `close` is left to do. */
+    sexpr *last;    /* Last cell whose car has been displayed. */
+    sexpr *vector;  /* Or else the vector being displayed... */
+    size_t index;   /* ...and the index of the item last displayed. */
+    char close;
+};
+
+static struct display_frame *display_stack = NULL;
+static size_t display_stack_size = 0;
+
+/* Clears the `printing` mark from every cell of the list's spine. */
+static void unmark_spine(struct display_frame *frame) {
+    sexpr *current = frame->head;
+
+    if (current == NULL) {
+        return;
+    }
+
+    while (current != frame->last) {
+        current->printing = 0;
+        current = current->cdr;
+    }
+    current->printing = 0;
+}
+
+/*
+ * Walks the structure with an explicit stack, so deeply nested lists can't
+ * overflow the C stack. Every cons cell on the spine of a list that is
+ * still open carries the `printing` mark: meeting one again means the
+ * structure is circular, and it's elided as "..." instead of looping
+ * forever.
+ */
+void display(sexpr* expr) {
+    size_t depth = 0;
+    struct display_frame *frame;
+    sexpr *rest;
+
+    while (1) {
+        /* Display expr -- or, if it's a list, just open it. */
+        if (expr == NIL) {
+            out_str("NIL");
+        } else if (expr->printing) {
+            out_str("...");
+        } else if ((expr->type == CONS) || (expr->type == FUNCTION)
+                || ((expr->type == VECTOR) && (expr->vector->length > 0))) {
+            if (depth == display_stack_size) {
+                display_stack_size = (depth == 0) ? 64 : depth * 2;
+                display_stack = realloc(display_stack,
+                        display_stack_size * sizeof(struct display_frame));
+                assert(display_stack != NULL);
+            }
+
+            frame = &display_stack[depth++];
+            frame->vector = NULL;
+            if (expr->type == VECTOR) {
+                out_str("#(");
+                frame->head = frame->last = NULL;
+                frame->vector = expr;
+                frame->index = 0;
+                expr->printing = 1;
+                expr = expr->vector->items[0];
+                continue;
+            } else if (expr->type == FUNCTION) {
+                /* A function is just a cons-cell. */
+                out_str(expr->macro ? "#<MACRO " : "#<LAMBDA ");
+                frame->head = frame->last = NULL;
+                frame->close = '>';
+            } else {
+                out_char('(');
+                frame->head = frame->last = expr;
+                frame->close = ')';
+                expr->printing = 1;
+            }
+
+            expr = expr->car;
+            continue;
+        } else {
+            display_atom(expr);
+        }
+
+        /* Then close every list that has run out of elements. */
+        while (depth > 0) {
+            frame = &display_stack[depth - 1];
+
+            if (frame->vector != NULL) {
+                if (++frame->index < frame->vector->vector->length) {
+                    out_char(' ');
+                    expr = frame->vector->vector->items[frame->index];
+                    break;
+                }
+                out_char(')');
+                frame->vector->printing = 0;
+                depth--;
+                continue;
+            }
+
+            if (frame->head == NULL) {
+                out_char(frame->close);
+                depth--;
+                continue;
+            }
+
+            rest = frame->last->cdr;
+            if (rest == NIL) {
+                out_char(')');
+            } else if (rest->printing) {
+                out_str(" ...)");
+            } else if (rest->type == CONS) {
+                /* On to the next element. */
+                out_char(' ');
+                rest->printing = 1;
+                frame->last = rest;
+                expr = rest->car;
+                break;
+            } else {
+                /* This must be the end of an improper list. */
+                out_str(" . ");
+                unmark_spine(frame);
+                frame->head = NULL;
+                expr = rest;
+                break;
+            }
+
+            unmark_spine(frame);
+            depth--;
+        }
+
+        if (depth == 0) {
+            return;
+        }
+    }
+}
+
 
 
 void print(sexpr *expr) {
     display(expr);
-    puts("");
+    out_char('\n');
 }
 
 /**
@@ -201,7 +843,7 @@ sexpr *lookup_pair(l_symbol symbol) {
         entry = entry->cdr;
     } while (entry != NIL);
 
-    printf("Could not find symbol: %d\n", symbol);
+    fprintf(stderr, "Could not find symbol: %d\n", symbol);
     assert(0);
 
     return NIL; /* For type-checking's sake. */
@@ -211,16 +853,16 @@ sexpr *lookup_pair(l_symbol symbol) {
  * Returns the s-expression representing the given symbol.
  */
 sexpr *slookup(l_symbol symbol) {
-    sexpr *ssymbol = lookup_pair(symbol);
-    return (ssymbol == NIL) ? NIL : ssymbol->car;
+    assert(symbol < (l_symbol) next_symbol_id);
+    return symbol_cells[symbol];
 }
 
 /**
  * Returns the string associated with the given symbol.
  */
 char *lookup(l_symbol symbol) {
-    sexpr *ssymbol = lookup_pair(symbol);
-    return (ssymbol == NULL) ? NULL : ssymbol->cdr->word;
+    assert(symbol < (l_symbol) next_symbol_id);
+    return symbol_names[symbol];
 }
 
 
@@ -232,6 +874,7 @@ static void prepare_execution_context(void);
 void init(void) {
     prepare_free_list();
     prepare_execution_context();
+    atexit(flush_output);
 }
 
 static void prepare_free_list(void) {
@@ -250,11 +893,18 @@ static void prepare_free_list(void) {
     }
 
     next_free_cell = last_value;
+    free_cell_count = HEAP_SIZE;
 }
 
 /* Returns the symbol ID if it exists, else returns -1. */
 static l_symbol find_symbol_by_name(char *name) {
     sexpr *current, *pair;
+    int initial = SYMBOL_HASH_SLOTS[name_hash(name, SYMBOL_HASH_SEED) & SYMBOL_HASH_MASK];
+
+    /* One probe for the initial symbols; the rest are searched for. */
+    if ((initial >= 0) && (strcmp(name, INITIAL_SYMBOLS[initial]) == 0)) {
+        return initial;
+    }
 
     current = name_list;
 
@@ -271,16 +921,19 @@ static l_symbol find_symbol_by_name(char *name) {
     return -1;
 }
 
+static l_symbol add_symbol(const char *name);
+
 static l_symbol insert_symbol(char *name) {
+    int id = find_symbol_by_name(name);
+    return (id != -1) ? id : add_symbol(name);
+}
+
+/* Gives name the next identifier, whether or not it has one already. */
+static l_symbol add_symbol(const char *name) {
     sexpr *pair, *identifier, *word;
 
     assert(strlen(name) < NAME_LENGTH);
 
-    int id = find_symbol_by_name(name);
-    if (id != -1) {
-        return id;
-    }
-
     identifier = new_cell();
     identifier->type = SYMBOL;
     identifier->symbol = next_symbol_id++;
@@ -295,6 +948,9 @@ static l_symbol insert_symbol(char *name) {
     word = new_cell();
     word->type = WORD;
     strncpy(word->word, name, NAME_LENGTH);
+    /* Names never move, and name_list keeps them alive forever. */
+    symbol_names[identifier->symbol] = word->word;
+    symbol_cells[identifier->symbol] = identifier;
 
     pair = cons(identifier, word);
 
@@ -304,29 +960,10 @@ static l_symbol insert_symbol(char *name) {
 }
 
 
-/* TODO: Make this less gross.
- *
- * It's important to keep this table in sync with the definitions in the
- * header file! */
-static char* INITIAL_SYMBOLS[] = {
-    /* Special forms. */
-    "COND", "DEFINE", "LABEL", "LAMBDA", "QUOTE",
-
-    "EVAL", "APPLY",
-    "CONS", "CAR", "CDR",
-
-    "EQ", "ATOM", "NULL", "NOT", "AND", "OR",
-    "+", "-", "/", "*", "<", ">",
-
-    "F", "T",
-    "MAP", "REDUCE", "GC"
-};
-
-
 static void insert_initial_symbols(void) {
     int i;
-    for (i = 0; i < sizeof(INITIAL_SYMBOLS)/sizeof(char**); i++) {
-        insert_symbol(INITIAL_SYMBOLS[i]);
+    for (i = 0; i < INITIAL_SYMBOL_COUNT; i++) {
+        add_symbol(INITIAL_SYMBOLS[i]);
     }
 }
 
@@ -343,17 +980,41 @@ static void prepare_execution_context(void) {
 #if GC_DEBUG
 #define GC_DEBUG_PRINT(msg, cell) \
     do {    \
-        printf(msg);    \
+        out_str(msg);   \
         display(cell);  \
-        puts("");   \
-    while (0)
+        out_char('\n');  \
+    } while (0)
 #else
-#define GC_DEBUG_PRINT() ((void) 0)
+#define GC_DEBUG_PRINT(msg, cell) ((void) 0)
 #endif
 
 #define NOT_VISITED     0
 #define FULLY_VISITED   3
 
+/* Cells whose car and cdr are pointers the marker must follow. */
+#define has_children(cell) \
+    (((cell)->type == CONS) || ((cell)->type == FUNCTION))
+
+/* Cells that point to cells from storage outside the heap. */
+#define is_container(cell) \
+    (((cell)->type == HASH_TABLE) || ((cell)->type == VECTOR) \
+     || ((cell)->type == CHANNEL))
+
+/*
+ * Containers reached but whose contents haven't been marked yet. Each cell
+ * is only ever pushed once -- as it's marked -- so this can't overflow.
+ */
+static sexpr *gray_cells[HEAP_SIZE];
+static int gray_count = 0;
+
+/* Marks a cell without children, deferring whatever it contains. */
+#define mark_leaf(cell) do { \
+        (cell)->reached = FULLY_VISITED; \
+        if (is_container(cell)) { \
+            gray_cells[gray_count++] = (cell); \
+        } \
+    } while (0)
+
 /*
  * Implementation inspired by:
  * [Gries06] D. Gries. Schorr-Waite Graph Marking Algorithm – Developed
@@ -399,9 +1060,10 @@ static int mark_cells(sexpr *cell) {
          * marked, the right child is marked due to the algorithm rotating its
          * pointer into the car position. See [Gries06] for full case
          * analysis. */
-        if (is_atom(current->car) && (current->car->reached != FULLY_VISITED)) {
+        if (!has_children(current->car)
+                && (current->car->reached != FULLY_VISITED)) {
             assert(current->car->reached == NOT_VISITED);
-            current->car->reached = FULLY_VISITED;
+            mark_leaf(current->car);
             count++;
         }
 
@@ -444,107 +1106,408 @@ static int mark_cells(sexpr *cell) {
     return count;
 }
 
-/* TODO: Rewrite this! */
-static int mark_all_reachable_cells(void) {
-    int count;
-    assert(global != NIL);
-
-    count = mark_cells(global);
-    count += mark_cells(name_list);
+/* Marks a cell that may or may not have children. */
+static int mark_root(sexpr *cell) {
+    if (has_children(cell)) {
+        return mark_cells(cell);
+    }
 
-#if GC_DEBUG
-    printf("Reached %d cells (%d total)\n", count, HEAP_SIZE);
-#endif
+    if (cell->reached != FULLY_VISITED) {
+        mark_leaf(cell);
+        return 1;
+    }
 
-    return count;
+    return 0;
 }
 
+static int mark_table(struct hash_table *table);
+static int mark_vector(struct vector *vector);
+static int mark_channel(struct channel *channel);
+static int mark_task_stacks(void *registers);
 
-static int garbage_collect(void) {
-    int freed;
-
-#if GC_DEBUG
-    puts("Garbage collecting...");
-#endif
+/* Marks the contents of every container reached so far -- including any
+ * containers found in the process. */
+static int mark_gray_cells(void) {
+    int count = 0;
+    sexpr *cell;
+
+    while (gray_count > 0) {
+        cell = gray_cells[--gray_count];
+        if (cell->type == HASH_TABLE) {
+            count += mark_table(cell->table);
+        } else if (cell->type == CHANNEL) {
+            count += mark_channel(cell->channel);
+        } else {
+            count += mark_vector(cell->vector);
+        }
+    }
 
-    mark_all_reachable_cells();
+    return count;
+}
 
-    /* For reached cells, unmark 'em. For unreached cells, return 'em to the
-     * free list. */
-    for (int i = 0; i < HEAP_SIZE; i++) {
-        sexpr *cell = heap + i;
+/*
+ * Conservatively treats every word between from and to as a potential
+ * pointer into the heap. Interior pointers count, since an optimizing
+ * compiler is free to keep one of those instead.
+ */
+static int mark_region(void *from, void *to) {
+    int count = 0;
+    uintptr_t low = (uintptr_t) heap, high = (uintptr_t) (heap + HEAP_SIZE);
+    uintptr_t *word;
 
-        if (cell->reached != FULLY_VISITED) {
-            /* Return the cell to the free list. */
-            cell->cdr = next_free_cell;
-            next_free_cell = cell;
-            freed++;
-        } else {
-            cell->reached = NOT_VISITED;
+    for (word = from; (void *) word < to; word++) {
+        if ((*word >= low) && (*word < high)) {
+            count += mark_root(heap + (*word - low) / sizeof(sexpr));
         }
     }
 
-#if GC_DEBUG
-    printf("Freed %d cells\n", freed);
-#endif
-    return freed;
+    return count;
 }
 
+/*
+ * Intermediate values in eval() and friends only live on the C stack, so
+ * it is scanned too -- as are the stacks of any tasks switched out.
+ * setjmp() spills any callee-saved registers into this frame first.
+ */
+static int __attribute__((noinline)) mark_stack(void) {
+    jmp_buf registers;
+
+    if (gc_stack_bottom == NULL) {
+        return 0;
+    }
 
-sexpr *new_cell(void) {
-    static unsigned int calls_to_new = 0;
+    setjmp(registers);
+    return mark_task_stacks(&registers);
+}
 
-    sexpr* cell = next_free_cell;
+/* Optimized bodies are only referred to by free_symbol_cache. Stale ones
+ * are let go. */
+static int mark_optimized_bodies(void) {
+    struct free_symbols *info;
+    int i, count = 0;
 
-    if (cell == NIL) {
-        garbage_collect();
-        cell = next_free_cell;
-        if (cell == NIL)  {
-            fprintf(stderr, "Ran out of cells in free list.\n");
-            exit(-1);
+    for (i = 0; i < HEAP_SIZE; i++) {
+        info = free_symbol_cache[i];
+        if ((info == NULL) || (info->optimized == NULL)) {
+            continue;
+        }
+
+        if (info->epoch != optimization_epoch) {
+            info->optimized = NULL;
+        } else {
+            count += mark_root(info->optimized);
         }
     }
 
-#if VERBOSE_DEBUG
-    printf("Cell %u: %p -> %p\n", calls_to_new++, cell, cell->cdr);
-#endif
+    return count;
+}
 
-    next_free_cell = cell->cdr;
+static int mark_all_reachable_cells(void) {
+    int count;
+    assert(global != NIL);
 
-    return cell;
-}
+    count = mark_cells(global);
+    count += mark_cells(name_list);
+    count += mark_cells(kept);
+    count += mark_stack();
+    count += mark_optimized_bodies();
+    count += mark_gray_cells();
 
-
+#if GC_DEBUG
+    out_printf("Reached %d cells (%d total)\n", count, HEAP_SIZE);
+#endif
 
-enum token {
+    return count;
+}
+
+
+static l_symbol current_site(void) {
+    if (call_depth == 0) {
+        return SITE_TOPLEVEL;
+    } else if (call_depth > MAX_CALL_DEPTH) {
+        return call_stack[MAX_CALL_DEPTH - 1];
+    }
+    return call_stack[call_depth - 1];
+}
+
+static void charge_allocation(sexpr *cell) {
+    l_symbol site = current_site();
+
+    cell_sites[cell - heap] = site;
+    site_allocated[site]++;
+}
+
+/* Everything allocated so far is charged to the top level. */
+static void start_allocation_report(void) {
+    int i;
+
+    for (i = 0; i < HEAP_SIZE; i++) {
+        cell_sites[i] = SITE_TOPLEVEL;
+    }
+}
+
+/* One line of JSON per collection, busiest sites first. */
+static void report_allocation_sites(void) {
+    l_symbol sites[MAX_NAMES + 1], site;
+    int count = 0, i, j;
+
+    for (site = 0; site <= SITE_TOPLEVEL; site++) {
+        if ((site_allocated[site] == 0) && (site_retained[site] == 0)) {
+            continue;
+        }
+        /* Insertion sort: there are only ever a handful of sites. */
+        for (j = count++; (j > 0) && (site_allocated[sites[j - 1]] < site_allocated[site]); j--) {
+            sites[j] = sites[j - 1];
+        }
+        sites[j] = site;
+    }
+
+    fprintf(allocation_report, "{\"collection\": %lu, \"sites\": [",
+            stats.collections);
+    for (i = 0; i < count; i++) {
+        site = sites[i];
+        fprintf(allocation_report,
+                "%s{\"site\": \"%s\", \"allocated\": %lu, \"retained\": %lu}",
+                (i > 0) ? ", " : "",
+                (site == SITE_TOPLEVEL) ? "[toplevel]" : lookup(site),
+                site_allocated[site], site_retained[site]);
+        site_allocated[site] = 0;
+    }
+    fprintf(allocation_report, "]}\n");
+}
+
+/* Releases anything an unreachable cell holds outside of the heap. */
+static void finalize_cell(sexpr *cell) {
+    if (cell->type == PORT) {
+        if ((cell->stream != NULL) && (cell->stream != stdin)) {
+            fclose(cell->stream);
+        }
+        /* So that it's never finalized twice. */
+        cell->type = CONS;
+        cell->car = NIL;
+    } else if (cell->type == HASH_TABLE) {
+        free(cell->table);
+        cell->type = CONS;
+        cell->car = NIL;
+    } else if (cell->type == VECTOR) {
+        free(cell->vector);
+        cell->type = CONS;
+        cell->car = NIL;
+    } else if (cell->type == F64_ARRAY) {
+        free(cell->f64);
+        cell->type = CONS;
+        cell->car = NIL;
+    } else if (cell->type == CHANNEL) {
+        /* Nothing is waiting on it, or it would have been reached. */
+        free(cell->channel->items);
+        free(cell->channel);
+        cell->type = CONS;
+        cell->car = NIL;
+    }
+}
+
+static int garbage_collect(void) {
+    int freed = 0, free_before = free_cell_count, interrupted_phase;
+    struct timespec start;
+    double pause;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stats.collections++;
+
+#if GC_DEBUG
+    out_str("Garbage collecting...\n");
+#endif
+
+    interrupted_phase = current_phase;
+    switch_phase(PHASE_GC);
+
+    mark_all_reachable_cells();
+    compact_strings();
+
+    if (allocation_report != NULL) {
+        memset(site_retained, 0, sizeof(site_retained));
+    }
+
+    /* The free list is rebuilt from scratch: GC can be forced while cells
+     * are still left on it. */
+    next_free_cell = NIL;
+    free_cell_count = 0;
+
+    /* For reached cells, unmark 'em. For unreached cells, return 'em to the
+     * free list -- from the top down, so that it runs up the heap and cells
+     * allocated one after another are next to each other; see new_list(). */
+    for (int i = HEAP_SIZE - 1; i >= 0; i--) {
+        sexpr *cell = heap + i;
+
+        if (cell->reached != FULLY_VISITED) {
+            finalize_cell(cell);
+            shared[i] = false;
+            if (free_symbol_cache[i] != NULL) {
+                free(free_symbol_cache[i]);
+                free_symbol_cache[i] = NULL;
+            }
+            /* Return the cell to the free list. */
+            cell->cdr = next_free_cell;
+            next_free_cell = cell;
+            free_cell_count++;
+            freed++;
+        } else {
+            cell->reached = NOT_VISITED;
+            if (allocation_report != NULL) {
+                site_retained[cell_sites[i]]++;
+            }
+        }
+    }
+
+    stats.cells_freed += freed - free_before;
+    stats.live_cells = HEAP_SIZE - freed;
+
+    if (hash_consing) {
+        rehash_shared();
+    }
+
+    pause = seconds_since(&start);
+    stats.pause_total += pause;
+    if (pause > stats.pause_max) {
+        stats.pause_max = pause;
+    }
+
+#if GC_DEBUG
+    out_printf("Freed %d cells\n", freed);
+#endif
+
+    if (allocation_report != NULL) {
+        report_allocation_sites();
+    }
+
+    switch_phase(interrupted_phase);
+
+    return freed;
+}
+
+/* Abandons the current read or evaluation, which went over budget. */
+static void exceed_budget(const char *message) {
+    fprintf(stderr, "%s\n", message);
+    longjmp(top_level_exception, LIMIT_EXCEEDED);
+}
+
+/* Starts the budgets over for the next top-level evaluation. */
+static void start_budgets(void) {
+    fuel_deadline = (fuel_limit > 0) ? stats.evaluations + fuel_limit : ULONG_MAX;
+    cell_deadline = (cell_limit > 0) ? stats.cells_allocated + cell_limit : ULONG_MAX;
+}
+
+/* Reading (or anything else outside of an evaluation) is never cut off. */
+static void end_budgets(void) {
+    fuel_deadline = cell_deadline = ULONG_MAX;
+}
+
+/* Records how long the free list lasted, then collects. */
+static void free_list_exhausted(void) {
+    unsigned long allocated = stats.cells_allocated - allocated_at_exhaustion;
+    int bucket = 0;
+
+    while ((allocated >>= 1) > 0 && (bucket < HISTOGRAM_BUCKETS - 1)) {
+        bucket++;
+    }
+
+    stats.exhaustions++;
+    stats.exhaustion_histogram[bucket]++;
+    allocated_at_exhaustion = stats.cells_allocated;
+
+    garbage_collect();
+}
+
+
+sexpr *new_cell(void) {
+    static unsigned int calls_to_new = 0;
+
+    sexpr* cell = next_free_cell;
+
+    if (cell == NIL) {
+        free_list_exhausted();
+        cell = next_free_cell;
+        if (cell == NIL)  {
+            exceed_budget("Ran out of cells in free list.");
+        }
+    }
+
+#if VERBOSE_DEBUG
+    out_printf("Cell %u: %p -> %p\n", calls_to_new++, cell, cell->cdr);
+#endif
+
+    next_free_cell = cell->cdr;
+    free_cell_count--;
+    if (++stats.cells_allocated > cell_deadline) {
+        exceed_budget("Allocated too many cells.");
+    }
+
+    if (allocation_report != NULL) {
+        charge_allocation(cell);
+    }
+
+    return cell;
+}
+
+/*
+ * Makes sure the next n calls to new_cell() will succeed without
+ * collecting, so the caller can hold new cells wherever it pleases.
+ */
+static bool reserve_cells(int n) {
+    if (free_cell_count < n) {
+        garbage_collect();
+    }
+    return free_cell_count >= n;
+}
+
+
+
+enum token {
     NONE,
     LBRACKET, RBRACKET,
     T_SYMBOL,
     T_NUMBER,
-    /* String? */
+    T_STRING,
+    T_DOT,
+    T_ERROR, /* A string that never ends. */
 };
 
 union token_data {
     char name[NAME_LENGTH];
     l_number number;
+    /* Points into string_token; good until the next string is read. */
+    struct {
+        char *text;
+        size_t length;
+    } string;
 };
 
+/* Holds the contents of the last string literal read -- by this thread:
+ * with -b, stdin is tokenized on one of its own. */
+static __thread char *string_token = NULL;
+static __thread size_t string_token_size = 0;
+
+static void syntax_error(void);
+static bool is_symbol_char(char c);
+
 /* Reads characters to make a symbol; any extra characters are truncated. */
-static void tokenize_symbol(char *);
+static void tokenize_symbol(FILE *in, char *);
+/* Reads the rest of a string literal, after its opening quote. */
+static bool tokenize_string(FILE *in, union token_data *state);
 
-static enum token next_token(union token_data *state) {
+static enum token next_token(FILE *in, union token_data *state) {
     int c;
 
-    while ((c = fgetc(stdin)) != EOF) {
+    while ((c = getc(in)) != EOF) {
         if (isspace(c))
             continue;
 
         /* Parse out comments. */
         if (c == ';') {
             do {
-                c = fgetc(stdin);
+                c = getc(in);
             } while ((c != '\n') && (c != EOF));
-            ungetc(c, stdin);
+            ungetc(c, in);
 
             continue;
         }
@@ -557,17 +1520,30 @@ static enum token next_token(union token_data *state) {
             return RBRACKET;
         }
 
+        if (c == '"') {
+            return tokenize_string(in, state) ? T_STRING : T_ERROR;
+        }
+
+        /* A dot on its own; "..." and the like are still symbols. */
+        if (c == '.') {
+            int next = getc(in);
+            ungetc(next, in);
+            if (!is_symbol_char(next)) {
+                return T_DOT;
+            }
+        }
+
         /* The following two rely on the read characters to be back on the
          * stream. */
 
-        ungetc(c, stdin);
+        ungetc(c, in);
         if (isdigit(c)) {
-            scanf("%lf", &state->number);
+            fscanf(in, "%lf", &state->number);
             return T_NUMBER;
         }
 
         /* If we got here, it's a symbol. */
-        tokenize_symbol(state->name);
+        tokenize_symbol(in, state->name);
         return T_SYMBOL;
     }
 
@@ -575,18 +1551,48 @@ static enum token next_token(union token_data *state) {
 }
 
 static bool is_symbol_char(char c) {
-    return !((c == EOF) || isspace(c) || (c == '(') || (c == ')'));
+    return !((c == EOF) || isspace(c) || (c == '(') || (c == ')') || (c == '"'));
+}
+
+static bool tokenize_string(FILE *in, union token_data *state) {
+    size_t length = 0;
+    int c;
+
+    while ((c = getc(in)) != '"') {
+        if (c == '\\') {
+            c = getc(in);
+            if (c == 'n') {
+                c = '\n';
+            } else if (c == 't') {
+                c = '\t';
+            }
+        }
+        if (c == EOF) {
+            return false;
+        }
+
+        if (length + 1 >= string_token_size) {
+            string_token_size = (string_token_size > 0) ? string_token_size * 2 : 256;
+            string_token = realloc(string_token, string_token_size);
+            assert(string_token != NULL);
+        }
+        string_token[length++] = c;
+    }
+
+    state->string.text = string_token;
+    state->string.length = length;
+    return true;
 }
 
-static void tokenize_symbol(char *buffer) {
+static void tokenize_symbol(FILE *in, char *buffer) {
     int i, c;
 
     for (i = 0; i < NAME_LENGTH - 1; i++) {
-        c = fgetc(stdin);
+        c = getc(in);
 
         if (!is_symbol_char(c)) {
             /* Finalize the buffer. */
-            ungetc(c, stdin);
+            ungetc(c, in);
             buffer[i] = '\0';
             return;
         }
@@ -604,205 +1610,762 @@ static void tokenize_symbol(char *buffer) {
 
     do {
         /* loop until non-symbol character. */;
-        c = fgetc(stdin);
+        c = getc(in);
     } while (is_symbol_char(c));
 
-    ungetc(c, stdin);
+    ungetc(c, in);
 }
 
-static sexpr* parse_list(void);
+/* How many lists deep the reader currently is. */
+static int depth = 0;
 
-sexpr* l_read(void) {
-    static int depth = 0;
+/* Returned by read_expr() to mark the end of a list. Not NIL, so that an
+ * empty list inside of a list does not end it. */
+static sexpr close_bracket = {
+    .type = CONS,
+    .reached = 0,
+    .car = &nil,
+    .cdr = &nil,
+};
+
+/* Returned by read_expr() for the dot in a dotted list. */
+static sexpr dot = {
+    .type = CONS,
+    .reached = 0,
+    .car = &nil,
+    .cdr = &nil,
+};
+
+static sexpr* parse_list(FILE *in);
+static sexpr *new_string(size_t length);
+static char *string_bytes(sexpr *string);
+static size_t string_length_of(sexpr *string);
+static sexpr *shared_atom(sexpr *probe);
+static sexpr *share(sexpr *cell);
+static sexpr *share_tree(sexpr *expr);
+
+static void syntax_error(void) {
+    depth = 0;
+    longjmp(top_level_exception, SYNTAX_ERROR);
+}
+
+static enum token next_queued_token(union token_data *data);
+static bool pipelined_input = false;
 
+static sexpr* read_expr(FILE *in) {
     sexpr *expr = NIL;
 
     enum token token;
     union token_data token_data;
 
-    token = next_token(&token_data);
+    token = (pipelined_input && (in == stdin))
+        ? next_queued_token(&token_data) : next_token(in, &token_data);
 
     switch (token) {
         case T_NUMBER:
+            if (hash_consing) {
+                return shared_atom(&(sexpr) { .type = NUMBER, .number = token_data.number });
+            }
             expr = new_cell();
             expr->type = NUMBER;
             expr->number = token_data.number;
             break;
 
         case T_SYMBOL:
+            if (hash_consing) {
+                return shared_atom(&(sexpr) { .type = SYMBOL,
+                        .symbol = insert_symbol(token_data.name) });
+            }
             expr = new_cell();
             expr->type = SYMBOL;
             expr->symbol = insert_symbol(token_data.name);
             break;
 
+        case T_STRING:
+            expr = new_string(token_data.string.length);
+            memcpy(string_bytes(expr), token_data.string.text, token_data.string.length);
+            if (hash_consing) {
+                expr = share(expr);
+            }
+            break;
+
         case LBRACKET:
             depth++;
-            return parse_list();
+            return parse_list(in);
 
         case RBRACKET:
             if (depth < 1) {
-                depth = 0;
-                longjmp(top_level_exception, SYNTAX_ERROR);
+                syntax_error();
             }
             depth--;
-            expr = NIL;
+            expr = &close_bracket;
+            break;
+
+        case T_DOT:
+            if (depth < 1) {
+                syntax_error();
+            }
+            expr = &dot;
+            break;
+
+        case T_ERROR:
+            syntax_error();
             break;
 
         case NONE:
-            longjmp(top_level_exception, END_INPUT);
-            expr = NIL;
-            /* Apparently this is a syntax error? */
+            /* Running out of input in the middle of a list is an error;
+             * anywhere else it's just the end. */
+            if (depth > 0) {
+                syntax_error();
+            }
+            expr = EOF_OBJECT;
             break;
     }
 
     return expr;
 }
 
+sexpr* l_read_from(FILE *in) {
+    depth = 0;
+    return read_expr(in);
+}
+
+sexpr* l_read(void) {
+    return l_read_from(stdin);
+}
+
 
 /* Parses the inside of a list. */
-static sexpr* parse_list(void) {
+static sexpr* parse_list(FILE *in) {
     sexpr *head, *last, *current, *inner;
 
     /* Read the first s-expr. */
-    inner = l_read();
+    inner = read_expr(in);
 
-    /* Don't bother allocating anything if it's NIL (such as if an RBRACKET
-     * was returned. */
-    if (inner == NIL) {
-        return inner;
+    /* Don't bother allocating anything if it's the empty list. */
+    if (inner == &close_bracket) {
+        return NIL;
+    } else if (inner == &dot) {
+        syntax_error();
     }
 
     last = head = new_cell();
     head->type = CONS;
     head->car = inner;
+    head->cdr = NIL;
 
-    inner = l_read();
+    inner = read_expr(in);
     /* Build up the list in order. */
-    while (inner != NIL) {
+    while (inner != &close_bracket) {
+        if (inner == &dot) {
+            /* (a b . c): exactly one more s-expression, then the end. */
+            inner = read_expr(in);
+            if ((inner == &close_bracket) || (inner == &dot)
+                    || (read_expr(in) != &close_bracket)) {
+                syntax_error();
+            }
+            last->cdr = inner;
+            break;
+        }
+
         current = new_cell();
         current->type = CONS;
         current->car = inner;
+        current->cdr = NIL;
 
         last->cdr = current;
         last = current;
 
-        inner = l_read();
+        inner = read_expr(in);
     }
 
-    last->cdr = NIL;
+    /* Only the data: the code around it may be rewritten in place. */
+    if (hash_consing && (head->car->type == SYMBOL) && (head->car->symbol == QUOTE)
+            && (head->cdr != NIL) && (head->cdr->type == CONS) && (head->cdr->cdr == NIL)) {
+        head->cdr->car = share_tree(head->cdr->car);
+    }
 
     return head;
 }
 
-
-
-/**************************** Built-in functions ****************************/
 
-/* Raise an evaluation error with the given message. */
-#define raise_eval_error(msg) \
-        fprintf(stderr, msg "\n"); \
-        longjmp(top_level_exception, EVAL_ERROR); \
-        return NIL // Semicolon omitted; should be provided in program text.
 
+/*
+ * Hash-consing. A list is shared once its car and cdr are, so comparing
+ * and hashing a cell only looks at what's in it, not at what's under it.
+ */
 
-sexpr *cons(sexpr* car, sexpr* cdr) {
-    sexpr *cell = new_cell();
-    cell->type = CONS;
+static uint64_t hash_string(sexpr *string);
 
-    cell->car = car;
-    cell->cdr = cdr;
+static uint64_t mix_bits(uint64_t bits);
 
-    return cell;
-}
+static uint64_t shared_hash(sexpr *cell) {
+    uint64_t bits;
 
-sexpr *car(sexpr *cons_cell) {
-    if (cons_cell == NIL) {
-        raise_eval_error("car called on nil");
-    } else if (cons_cell->type != CONS) {
-        raise_eval_error("car called on an atom");
+    switch (cell->type) {
+        case NUMBER:
+            /* Bit for bit, so that 0 and -0 stay apart. */
+            memcpy(&bits, &cell->number, sizeof(bits));
+            return mix_bits(bits);
+        case SYMBOL:
+            return mix_bits(cell->symbol);
+        case STRING:
+            return hash_string(cell);
+        default:
+            return mix_bits((uintptr_t) cell->car * 31 + (uintptr_t) cell->cdr);
     }
-
-    return cons_cell->car;
 }
 
-sexpr *cdr(sexpr *cons_cell) {
-    if (cons_cell == NIL) {
-        raise_eval_error("cdr called on NIL");
-    } else if (cons_cell->type != CONS) {
-        raise_eval_error("cdr called on an atom");
+static bool same_contents(sexpr *a, sexpr *b) {
+    if (a->type != b->type) {
+        return false;
     }
 
-    return cons_cell->cdr;
-}
-
-sexpr *to_lisp_boolean(bool result) {
-    if (result) {
-        /* True is really weird, you guys... */
-        return slookup(T);
+    switch (a->type) {
+        case NUMBER:
+            return memcmp(&a->number, &b->number, sizeof(a->number)) == 0;
+        case SYMBOL:
+            return a->symbol == b->symbol;
+        case STRING:
+            return (string_length_of(a) == string_length_of(b))
+                && (memcmp(string_bytes(a), string_bytes(b), string_length_of(a)) == 0);
+        default:
+            return (a->car == b->car) && (a->cdr == b->cdr);
     }
-    /* NIL is false... I guess. */
-    return NIL;
 }
 
-bool c_atom(sexpr *expr) {
-    if ((expr == NIL) || (expr->type != CONS)) {
-        return true;
-    } else {
-        return false;
-    }
+static bool can_share(sexpr *cell) {
+    return (cell != NIL) && IS_HEAP_CELL(cell)
+        && ((cell->type == CONS) || (cell->type == NUMBER)
+                || (cell->type == SYMBOL) || (cell->type == STRING));
 }
 
-bool c_eq(sexpr *a, sexpr *b) {
-    if ((a->type != CONS) && (a->type == b->type)) {
-        switch (a->type) {
-            case NUMBER:
-                return a->number == b->number;
-            case SYMBOL:
-                return a->symbol == b->symbol;
-            case LAMBDA:
-                return a == b;
-            default:
-                return false;
+static sexpr *find_shared(sexpr *probe, uint64_t hash) {
+    uint32_t i;
+
+    for (i = shared_buckets[hash % HEAP_SIZE]; i != 0; i = shared_next[i - 1]) {
+        if (same_contents(heap + i - 1, probe)) {
+            return heap + i - 1;
         }
     }
-    return false;
+    return NULL;
 }
 
-sexpr *atom(sexpr *expr) {
-    return to_lisp_boolean(c_atom(expr));
+static void add_shared(sexpr *cell, uint64_t hash) {
+    size_t i = cell - heap;
+
+    shared[i] = true;
+    shared_next[i] = shared_buckets[hash % HEAP_SIZE];
+    shared_buckets[hash % HEAP_SIZE] = i + 1;
 }
 
-sexpr *eq(sexpr *a, sexpr *b) {
-    return  to_lisp_boolean(c_eq(a, b));
+/* The shared cell equal to cell; cell itself if there wasn't one. */
+static sexpr *share(sexpr *cell) {
+    uint64_t hash;
+    sexpr *found;
+
+    if (!can_share(cell) || shared[cell - heap]) {
+        return cell;
+    }
+
+    hash = shared_hash(cell);
+    if ((found = find_shared(cell, hash)) != NULL) {
+        return found;
+    }
+    add_shared(cell, hash);
+    return cell;
 }
 
-
+/* Like share(), for a number or symbol that isn't in the heap yet. */
+static sexpr *shared_atom(sexpr *probe) {
+    uint64_t hash = shared_hash(probe);
+    sexpr *cell = find_shared(probe, hash);
+
+    if (cell == NULL) {
+        cell = new_cell();
+        cell->type = probe->type;
+        if (probe->type == NUMBER) {
+            cell->number = probe->number;
+        } else {
+            cell->symbol = probe->symbol;
+        }
+        add_shared(cell, hash);
+    }
+    return cell;
+}
+
+/*
+ * Shares every cell of a freshly read expression, bottom up. The spine is
+ * reversed on the way down and put back on the way up, so long lists take
+ * no C stack. Nothing here allocates, so the collector never sees it
+ * half-done.
+ */
+static sexpr *share_tree(sexpr *expr) {
+    sexpr *previous = NULL, *next, *result;
+
+    if (!hash_consing) {
+        return expr;
+    }
+
+    while ((expr != NIL) && (expr->type == CONS) && !shared[expr - heap]) {
+        next = expr->cdr;
+        expr->car = share_tree(expr->car);
+        expr->cdr = previous;
+        previous = expr;
+        expr = next;
+    }
+
+    for (result = share(expr); previous != NULL; previous = next) {
+        next = previous->cdr;
+        previous->cdr = result;
+        result = share(previous);
+    }
+    return result;
+}
+
+/* After a collection: chains can't go through cells that were freed. */
+static void rehash_shared(void) {
+    size_t i;
+
+    memset(shared_buckets, 0, sizeof(shared_buckets));
+    for (i = 0; i < HEAP_SIZE; i++) {
+        if (shared[i]) {
+            add_shared(heap + i, shared_hash(heap + i));
+        }
+    }
+}
+
+
+
+/*
+ * Pipelined batch mode (-b). A reader thread tokenizes stdin ahead of the
+ * evaluator, and a writer thread writes out what's been printed while the
+ * next expression is evaluated. Building cells, evaluating and formatting
+ * stay on the main thread -- nothing else may touch the heap -- so the
+ * output is exactly what it would be without -b.
+ */
+
+#define TOKEN_BLOCK_SIZE    256
+#define TOKEN_BLOCKS        16 /* How far ahead the reader may get. */
+
+struct queued_token {
+    enum token token;
+    union token_data data;
+    size_t string_offset; /* Into the block's text; data.string.text is unset. */
+};
+
+struct token_block {
+    size_t count;
+    struct queued_token tokens[TOKEN_BLOCK_SIZE];
+    char *text; /* The bytes of the block's strings. */
+    size_t text_length, text_size;
+};
+
+static struct token_block token_blocks[TOKEN_BLOCKS];
+/* Blocks filled and not yet consumed are [first_block, first_block + filled_blocks). */
+static size_t first_block = 0, filled_blocks = 0;
+/* Whether the evaluator has the first block yet, and where it is in it. */
+static bool holding_block = false;
+static size_t next_queued = 0;
+
+static pthread_mutex_t pipeline_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t block_filled = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t block_consumed = PTHREAD_COND_INITIALIZER;
+
+/* The buffer being written out, if any. */
+static bool writer_running = false;
+static const char *writing = NULL;
+static size_t writing_length = 0;
+static pthread_cond_t output_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t output_written = PTHREAD_COND_INITIALIZER;
+
+static void publish_block(void) {
+    pthread_mutex_lock(&pipeline_lock);
+    filled_blocks++;
+    pthread_cond_signal(&block_filled);
+    while (filled_blocks == TOKEN_BLOCKS) {
+        pthread_cond_wait(&block_consumed, &pipeline_lock);
+    }
+    pthread_mutex_unlock(&pipeline_lock);
+}
+
+static void *read_tokens(void *unused) {
+    struct token_block *block;
+    struct queued_token *queued;
+    size_t filling = 0, length;
+
+    for (;;) {
+        block = &token_blocks[filling];
+        queued = &block->tokens[block->count++];
+
+        queued->token = next_token(stdin, &queued->data);
+        if (queued->token == T_STRING) {
+            length = queued->data.string.length;
+            if (block->text_length + length > block->text_size) {
+                block->text_size = 2 * (block->text_length + length) + 256;
+                block->text = realloc(block->text, block->text_size);
+                assert(block->text != NULL);
+            }
+            memcpy(block->text + block->text_length, queued->data.string.text, length);
+            queued->string_offset = block->text_length;
+            block->text_length += length;
+        }
+
+        /* Handing over a block at a time keeps the threads out of each
+         * other's way; but then batch input is all there to be read. */
+        if ((queued->token == NONE) || (block->count == TOKEN_BLOCK_SIZE)) {
+            publish_block();
+            filling = (filling + 1) % TOKEN_BLOCKS;
+        }
+        if (queued->token == NONE) {
+            return NULL;
+        }
+    }
+}
+
+/* next_token() for stdin, from the tokens read_tokens() queued. */
+static enum token next_queued_token(union token_data *data) {
+    struct token_block *block = &token_blocks[first_block];
+    struct queued_token *queued;
+
+    if (!holding_block || (next_queued == block->count)) {
+        pthread_mutex_lock(&pipeline_lock);
+        /* Done with this block; the reader can have it back. */
+        if (holding_block) {
+            block->count = block->text_length = 0;
+            first_block = (first_block + 1) % TOKEN_BLOCKS;
+            filled_blocks--;
+            next_queued = 0;
+            pthread_cond_signal(&block_consumed);
+        }
+        while (filled_blocks == 0) {
+            pthread_cond_wait(&block_filled, &pipeline_lock);
+        }
+        holding_block = true;
+        pthread_mutex_unlock(&pipeline_lock);
+        block = &token_blocks[first_block];
+    }
+
+    queued = &block->tokens[next_queued];
+    *data = queued->data;
+    if (queued->token == T_STRING) {
+        data->string.text = block->text + queued->string_offset;
+    }
+    /* The end of input stays the end of input. */
+    if (queued->token != NONE) {
+        next_queued++;
+    }
+    return queued->token;
+}
+
+static void *write_output(void *unused) {
+    pthread_mutex_lock(&pipeline_lock);
+    for (;;) {
+        while (writing == NULL) {
+            pthread_cond_wait(&output_queued, &pipeline_lock);
+        }
+        pthread_mutex_unlock(&pipeline_lock);
+
+        fwrite(writing, 1, writing_length, stdout);
+        fflush(stdout);
+
+        pthread_mutex_lock(&pipeline_lock);
+        writing = NULL;
+        pthread_cond_signal(&output_written);
+    }
+    return NULL;
+}
+
+/* Gives the writer thread the output buffer, if there is a writer thread. */
+static bool hand_off_output(bool wait) {
+    if (!writer_running) {
+        return false;
+    }
+
+    pthread_mutex_lock(&pipeline_lock);
+    while (writing != NULL) {
+        pthread_cond_wait(&output_written, &pipeline_lock);
+    }
+    if (output_length > 0) {
+        writing = output_buffer;
+        writing_length = output_length;
+        output_buffer = (output_buffer == output_buffers[0])
+            ? output_buffers[1] : output_buffers[0];
+        pthread_cond_signal(&output_queued);
+    }
+    while (wait && (writing != NULL)) {
+        pthread_cond_wait(&output_written, &pipeline_lock);
+    }
+    pthread_mutex_unlock(&pipeline_lock);
+
+    return true;
+}
+
+static void start_pipeline(void) {
+    pthread_t reader, writer;
+
+    /* On one processor the threads would only take turns. */
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        return;
+    }
+
+    if (pthread_create(&reader, NULL, read_tokens, NULL) == 0) {
+        pthread_detach(reader);
+        pipelined_input = true;
+    }
+    if (pthread_create(&writer, NULL, write_output, NULL) == 0) {
+        pthread_detach(writer);
+        writer_running = true;
+    }
+}
+
+
+
+
+/**************************** Built-in functions ****************************/
+
+/* Raise an evaluation error with the given message. */
+#define raise_eval_error(msg) \
+        fprintf(stderr, msg "\n"); \
+        longjmp(top_level_exception, EVAL_ERROR); \
+        return NIL // Semicolon omitted; should be provided in program text.
+
+
+/*
+ * A list of length NILs, in one piece: the free list runs up the heap, so
+ * when its next cells are free the list is laid out in order, each cell's
+ * cdr the cell after it, and walking it is a sequential scan. This is not
+ * CDR-coding: each cell is still a whole cons, and no memory is saved.
+ */
+static sexpr *new_list(size_t length) {
+    sexpr *head = NIL, *last = NIL, *cell;
+
+    while (length-- > 0) {
+        cell = new_cell();
+        cell->type = CONS;
+        cell->car = NIL;
+        cell->cdr = NIL;
+
+        if (head == NIL) {
+            head = cell;
+        } else {
+            last->cdr = cell;
+        }
+        last = cell;
+    }
+    return head;
+}
+
+sexpr *cons(sexpr* car, sexpr* cdr) {
+    sexpr *cell = new_cell();
+    cell->type = CONS;
+
+    cell->car = car;
+    cell->cdr = cdr;
+
+    return cell;
+}
+
+sexpr *car(sexpr *cons_cell) {
+    if (cons_cell == NIL) {
+        raise_eval_error("car called on nil");
+    } else if (cons_cell->type != CONS) {
+        raise_eval_error("car called on an atom");
+    }
+
+    return cons_cell->car;
+}
+
+sexpr *cdr(sexpr *cons_cell) {
+    if (cons_cell == NIL) {
+        raise_eval_error("cdr called on NIL");
+    } else if (cons_cell->type != CONS) {
+        raise_eval_error("cdr called on an atom");
+    }
+
+    return cons_cell->cdr;
+}
+
+sexpr *to_lisp_boolean(bool result) {
+    if (result) {
+        /* True is really weird, you guys... */
+        return slookup(T);
+    }
+    /* NIL is false... I guess. */
+    return NIL;
+}
+
+bool c_atom(sexpr *expr) {
+    if ((expr == NIL) || (expr->type != CONS)) {
+        return true;
+    } else {
+        return false;
+    }
+}
+
+static int compare_strings(sexpr *a, sexpr *b);
+
+bool c_eq(sexpr *a, sexpr *b) {
+    if ((a->type != CONS) && (a->type == b->type)) {
+        switch (a->type) {
+            case NUMBER:
+                return a->number == b->number;
+            case SYMBOL:
+                return a->symbol == b->symbol;
+            case STRING:
+                return compare_strings(a, b) == 0;
+            case LAMBDA:
+            case END_OF_FILE:
+            case PORT:
+            case HASH_TABLE:
+            case VECTOR:
+            case F64_ARRAY:
+            case CHANNEL:
+                return a == b;
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+sexpr *atom(sexpr *expr) {
+    return to_lisp_boolean(c_atom(expr));
+}
+
+sexpr *eq(sexpr *a, sexpr *b) {
+    return  to_lisp_boolean(c_eq(a, b));
+}
+
+/* Structural equality. Shared lists are equal as soon as they're the same. */
+bool c_equal(sexpr *a, sexpr *b) {
+    for (; a != b; a = a->cdr, b = b->cdr) {
+        if ((a == NIL) || (b == NIL) || (a->type != CONS) || (b->type != CONS)) {
+            return (a != NIL) && (b != NIL) && c_eq(a, b);
+        } else if (!c_equal(a->car, b->car)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+sexpr *equal(sexpr *a, sexpr *b) {
+    return to_lisp_boolean(c_equal(a, b));
+}
+
+
 
 static sexpr* eval_atom(sexpr *atom, sexpr *env);
-static sexpr* eval_cond(sexpr *conditions, sexpr *env);
+static sexpr* select_cond_branch(sexpr *conditions, sexpr *env);
 static sexpr* eval_form(l_symbol symbol, sexpr *args, sexpr *env);
 static sexpr* create_lambda(sexpr *formal_args, sexpr *body, sexpr *env);
+static sexpr* closure_body(sexpr *func);
+static sexpr *expand_in_place(sexpr *form, sexpr *macro);
+static sexpr *native_call(sexpr *func, sexpr *args);
 /* Equivalent to (map eval args). */
 static sexpr* eval_list(sexpr *args, sexpr *env);
+static sexpr *new_list(size_t length);
+sexpr *bind_args(sexpr *free_vars, sexpr* values, sexpr *old_env);
+
+static void push_call(l_symbol name) {
+    if (call_depth >= depth_limit) {
+        exceed_budget("Recursion too deep.");
+    }
+    if (call_depth < MAX_CALL_DEPTH) {
+        call_stack[call_depth] = name;
+    }
+    call_depth++;
+}
 
+/* What to call func in the call stack, given the expression it came from. */
+static l_symbol call_name(sexpr *func, sexpr *site) {
+    if ((func != NIL) && (func->type == FUNCTION) && closure_names[func - heap]) {
+        return closure_names[func - heap] - 1;
+    } else if (site->type == SYMBOL) {
+        return site->symbol;
+    } else if (site->type == BUILT_IN_FUNCTION) {
+        return site->builtin_symbol;
+    }
+    return LAMBDA;
+}
+
+static bool is_special_form(l_symbol symbol) {
+    return (symbol == COND) || (symbol == DEFINE) || (symbol == LABEL)
+        || (symbol == LAMBDA) || (symbol == QUOTE) || (symbol == TIME)
+        || (symbol == DEFMACRO);
+}
+
+/*
+ * Tail positions -- the chosen branch of a COND and the body of a lambda --
+ * loop instead of recursing, so an iterative program runs in constant
+ * stack (and, with the collector, constant heap).
+ */
 sexpr* eval(sexpr *expr, sexpr *env) {
-    sexpr* evaluation;
+    sexpr *func, *args, *result;
+    int frame = call_depth;
 
     if (env == NIL) {
         env = global;
     }
 
-    if (c_atom(expr)) {
-        return eval_atom(expr, env);
+    if (++stats.evaluations > fuel_deadline) {
+        exceed_budget("Out of fuel.");
     }
 
-    if (expr->car->type == SYMBOL) {
-        /* Try to evaluate a special form. */
-        return eval_form(expr->car->symbol, expr->cdr, env);
-    } else {
-        return apply(eval(car(expr), env), cdr(expr));
+    while (!c_atom(expr)) {
+        if (expr->car->type == SYMBOL) {
+            if (expr->car->symbol == COND) {
+                expr = select_cond_branch(expr->cdr, env);
+                continue;
+            }
+
+            if (is_special_form(expr->car->symbol)) {
+                push_call(expr->car->symbol);
+                result = eval_form(expr->car->symbol, expr->cdr, env);
+                call_depth = frame;
+                return result;
+            }
+
+            func = assoc(expr->car->symbol, env);
+            if ((func != NIL) && func->macro) {
+                expr = expand_in_place(expr, func);
+                continue;
+            }
+        } else if (expr->car->type == BUILT_IN_FUNCTION) {
+            /* Put in place of its name by partially_evaluate() -- unless
+             * that name has been rebound since. */
+            func = redefined[expr->car->builtin_symbol]
+                ? assoc(expr->car->builtin_symbol, env) : expr->car;
+        } else {
+            func = eval(car(expr), env);
+        }
+
+        args = eval_list(cdr(expr), env);
+
+        if ((func == NIL) || (func->type != FUNCTION)) {
+            push_call(call_name(func, expr->car));
+            result = apply(func, args);
+            call_depth = frame;
+            return result;
+        }
+
+        /* Evaluate the body in place of the call -- and of its frame. */
+        call_depth = frame;
+        if ((result = native_call(func, args)) != NULL) {
+            return result;
+        }
+        push_call(call_name(func, expr->car));
+
+        env = bind_args(func->cdr->car, args, func->cdr->cdr);
+        expr = closure_body(func);
+        if (++stats.evaluations > fuel_deadline) {
+            exceed_budget("Out of fuel.");
+        }
     }
 
+    result = eval_atom(expr, env);
+    call_depth = frame;
+    return result;
 }
 
 static sexpr* call_builtin(l_builtin func, sexpr *args);
@@ -810,9 +2373,9 @@ static sexpr* apply_lambda(sexpr *func, sexpr *args);
 
 sexpr *apply(sexpr *func, sexpr *args) {
 #if VERBOSE_DEBUG
-    printf("Applying: ");
+    out_str("Applying: ");
     display(func);
-    puts("");
+    out_char('\n');
 #endif
 
     if (func == NIL) {
@@ -829,6 +2392,14 @@ sexpr *apply(sexpr *func, sexpr *args) {
     return NIL;
 }
 
+/* Runs func's compiled or JITted code, if it has any; NULL if not. */
+static sexpr *native_call(sexpr *func, sexpr *args) {
+    if (compiled_closures[func - heap] != NULL) {
+        return call_builtin(compiled_closures[func - heap], args);
+    }
+    return jit_call(func, args);
+}
+
 
 
 static sexpr *eval_atom(sexpr *expr, sexpr *env) {
@@ -845,18 +2416,20 @@ static sexpr *eval_atom(sexpr *expr, sexpr *env) {
 }
 
 
-/* Evaluates a cons cell. */
+/* Code optimized against an initial symbol's binding is wrong once it's
+ * rebound. */
+static void rebind_initial_symbol(sexpr *name) {
+    if ((name != NIL) && (name->type == SYMBOL) && (name->symbol < INITIAL_SYMBOL_COUNT)) {
+        redefined[name->symbol] = true;
+        optimization_epoch++;
+    }
+}
+
+/* Evaluates a special form. COND is handled by eval() itself. */
 static sexpr* eval_form(l_symbol symbol, sexpr *args, sexpr *env) {
     sexpr *evaluation, *temp_env;
 
-    /*
-     * Evaluate all special forms and built-in functions.
-     */
     switch (symbol) {
-        case COND:
-            return eval_cond(args, env);
-            break;
-
         /* TODO: Should this even be a thing?  Or should it be combined with
          * LABEL? */
         case DEFINE:
@@ -865,6 +2438,8 @@ static sexpr* eval_form(l_symbol symbol, sexpr *args, sexpr *env) {
 
         case LABEL:
             /* This one is weird. */
+            rebind_initial_symbol(car(args));
+
             /* Update enivorment first... */
             temp_env = update_environment(&global, car(args), NIL);
             evaluation = eval(car(cdr(args)), temp_env);
@@ -872,21 +2447,40 @@ static sexpr* eval_form(l_symbol symbol, sexpr *args, sexpr *env) {
             /* Then MUTATE the environment. */
             temp_env->car->cdr = evaluation;
 
+            if ((evaluation != NIL) && (evaluation->type == FUNCTION)) {
+                closure_names[evaluation - heap] = temp_env->car->car->symbol + 1;
+            }
+
             return evaluation;
 
         case LAMBDA:
             return create_lambda(car(args), car(cdr(args)), env);
             break;
 
+        case DEFMACRO:
+            /* (DEFMACRO name formals body) */
+            rebind_initial_symbol(car(args));
+            /* Whatever was optimized might have been a call of it. */
+            optimization_epoch++;
+
+            evaluation = create_lambda(car(cdr(args)), car(cdr(cdr(args))), env);
+            evaluation->macro = true;
+            update_environment(&global, car(args), evaluation);
+            closure_names[evaluation - heap] = car(args)->symbol + 1;
+            return evaluation;
+
         case QUOTE:
             return car(args);
             break;
 
+        case TIME:
+            return time_evaluation(car(args), env);
+
         default:
-            /* Not a special form -- delegate to apply. */
-            return apply(assoc(symbol, env), eval_list(args, env));
+            assert(0);
     }
 
+    return NIL;
 }
 
 /*
@@ -895,25 +2489,27 @@ static sexpr* eval_form(l_symbol symbol, sexpr *args, sexpr *env) {
  */
 sexpr *eval_list(sexpr *args, sexpr *env) {
     sexpr *head, *unevaluated, *current;
+    size_t length = 0;
 
-    if (args == NIL) {
-        return NIL;
+    for (unevaluated = args; (unevaluated != NIL) && (unevaluated->type == CONS);
+            unevaluated = unevaluated->cdr) {
+        length++;
     }
 
-    current = head = cons(eval(car(args), env), NIL);
-    unevaluated = cdr(args);
-
-    while (unevaluated != NIL) {
-        current->cdr = cons(eval(car(unevaluated), env), NIL);
-        /* Advance positions in both lists. */
-        unevaluated = unevaluated->cdr;
-        current = current->cdr;
+    /* The spine first, so the arguments' garbage doesn't end up in it. */
+    head = new_list(length);
+    for (current = head; current != NIL; current = current->cdr) {
+        current->car = eval(args->car, env);
+        args = args->cdr;
+    }
+    if (args != NIL) {
+        car(args); /* Not a proper list. */
     }
 
 #if VERBOSE_DEBUG
-    printf("Evaluated list: ");
+    out_str("Evaluated list: ");
     display(head);
-    puts("");
+    out_char('\n');
 #endif
 
     return head;
@@ -926,8 +2522,8 @@ bool is_truthy(sexpr *value) {
         && (value->symbol == T);
 }
 
-/* Evaluates the true condition list. */
-sexpr *eval_cond(sexpr *conditions, sexpr *env) {
+/* Returns the (unevaluated) expression of the true condition. */
+static sexpr *select_cond_branch(sexpr *conditions, sexpr *env) {
     sexpr *current, *cond_pair, *result;
 
     for (current = conditions; current != NIL; current = cdr(current)) {
@@ -936,7 +2532,7 @@ sexpr *eval_cond(sexpr *conditions, sexpr *env) {
         result = eval(car(cond_pair), env);
 
         if (is_truthy(result)) {
-            return eval(car(cdr(cond_pair)), env);
+            return car(cdr(cond_pair));
         }
     }
 
@@ -963,9 +2559,9 @@ sexpr *call_builtin(l_builtin func, sexpr *args) {
         current = cdr(current);
 
 #if VERBOSE_DEBUG
-        printf("arg %d: ", i);
+        out_printf("arg %d: ", i);
         display(argv[i]);
-        puts("");
+        out_char('\n');
 #endif
     }
 
@@ -982,6 +2578,12 @@ sexpr *bind_args(sexpr *free_vars, sexpr* values, sexpr *old_env) {
     value_pair = values;
 
     while (symbol_pair != NIL) {
+        if (symbol_pair->type != CONS) {
+            /* A rest argument gets whatever is left. */
+            update_environment(&env, symbol_pair, value_pair);
+            return env;
+        }
+
         if (value_pair == NIL) {
             raise_eval_error("Not enough arguments for function.");
         }
@@ -1002,14 +2604,19 @@ sexpr *bind_args(sexpr *free_vars, sexpr* values, sexpr *old_env) {
 sexpr *apply_lambda(sexpr *lambda, sexpr *args) {
     assert((lambda != NIL) && (lambda->type == FUNCTION));
 
-    sexpr *body = lambda->car;
+    sexpr *native = native_call(lambda, args);
+    if (native != NULL) {
+        return native;
+    }
+
+    sexpr *body = closure_body(lambda);
     sexpr *free_vars = lambda->cdr->car;
     sexpr *env = bind_args(free_vars, args, lambda->cdr->cdr);
 
 #if VERBOSE_DEBUG
-    printf("Calling enviroment for func is: ");
+    out_str("Calling enviroment for func is: ");
     display(env);
-    puts("");
+    out_char('\n');
 #endif
 
     /* 0-arity function. Apply with existing environment. */
@@ -1024,62 +2631,656 @@ sexpr *update_environment(sexpr **env, sexpr* symbol, sexpr *value) {
     binding->cdr = value;
 
 #if VERBOSE_DEBUG
-    printf("Updating enviroment: ");
+    out_str("Updating enviroment: ");
     display(*env);
-    puts("");
+    out_char('\n');
 #endif
 
     *env = cons(binding, *env);
 
 #if VERBOSE_DEBUG
-    printf("Environment is now: ");
+    out_str("Environment is now: ");
     display(*env);
-    puts("");
+    out_char('\n');
 #endif
 
     return *env;
 }
 
-/**
- * Lambdas are actually just cons cells.
- *
- * (body . (formal-arguments . lexical-environment))
- *
- * For example, the inner lambda in this expression:
- *      (lambda (a b) (lambda (m) (m a b)))
+/*
+ * Macros.
  *
- * Is:
- *      ((m a b) . ((m) . ((a . BOUND-A) (b . BOUND-B) . ENV)))
+ * A macro is a function with its macro bit set. A call of one is replaced,
+ * in place, by what the macro returns given the call's unevaluated
+ * arguments -- so each call is only ever expanded once. Lambda bodies are
+ * expanded all at once the first time they're seen, and anything missed
+ * (say, a macro defined after the lambda) is expanded when it's evaluated.
+ * Only code the interpreter owns is rewritten: EVAL is given data, so it
+ * evaluates a copy.
  */
-static sexpr* create_lambda(sexpr *formal_args, sexpr *body, sexpr *env) {
-    sexpr *lambda = cons(body, cons(formal_args, env));
-    lambda->type = FUNCTION;
 
-    return lambda;
-}
+static sexpr *find_binding(l_symbol symbol, sexpr *environment);
+static void expand_macros(sexpr *expr);
 
+/* Returns what to evaluate instead: form, rewritten -- or, if it's
+ * shared, the expansion itself, to be expanded again next time. */
+static sexpr *expand_in_place(sexpr *form, sexpr *macro) {
+    sexpr *expansion;
+    int frame = call_depth;
 
-/* Returns the first expression that is associated with the symbol in the
- * given environment. */
-sexpr* assoc(l_symbol symbol, sexpr *environment) {
-    sexpr *current, *pair;
+    push_call(call_name(macro, form->car));
+    expansion = apply(macro, form->cdr);
+    call_depth = frame;
 
-    if (environment == NIL) {
-        environment = global;
+    if (is_shared(form)) {
+        return expansion;
     }
 
-    current = environment;
+    if ((expansion != NIL) && (expansion->type == CONS)) {
+        form->car = expansion->car;
+        form->cdr = expansion->cdr;
+    } else {
+        /* The call can't become an atom, but this evaluates to it. */
+        form->cdr = cons(cons(cons(slookup(QUOTE), cons(slookup(T), NIL)),
+                    cons(expansion, NIL)), NIL);
+        form->car = slookup(COND);
+    }
+    return form;
+}
 
-    /* Find the first symbol. */
-    while (current != NIL) {
-        pair = current->car;
+static void expand_list(sexpr *list) {
+    for (; (list != NIL) && (list->type == CONS); list = list->cdr) {
+        expand_macros(list->car);
+    }
+}
+
+/* Expands every call of a (global) macro in expr. */
+static void expand_macros(sexpr *expr) {
+    sexpr *head, *pair;
+
+    /* Anything shared is left for eval() to expand as it goes. */
+    while ((expr != NIL) && (expr->type == CONS) && !is_shared(expr)) {
+        head = expr->car;
+
+        if ((head == NIL) || (head->type != SYMBOL)) {
+            expand_list(expr);
+            return;
+        }
+
+        if (is_special_form(head->symbol)) {
+            switch (head->symbol) {
+                case COND:
+                    for (pair = expr->cdr; (pair != NIL) && (pair->type == CONS); pair = pair->cdr) {
+                        expand_list(pair->car);
+                    }
+                    break;
+                case LAMBDA:
+                case LABEL:
+                    /* Skip the formals or name. */
+                    if ((expr->cdr != NIL) && (expr->cdr->type == CONS)) {
+                        expand_list(expr->cdr->cdr);
+                    }
+                    break;
+                case TIME:
+                    expand_list(expr->cdr);
+                    break;
+            }
+            return;
+        }
+
+        pair = find_binding(head->symbol, global);
+        if ((pair == NULL) || (pair->cdr == NIL) || !pair->cdr->macro) {
+            expand_list(expr->cdr);
+            return;
+        }
+        /* And expand whatever it expanded to. */
+        expand_in_place(expr, pair->cdr);
+    }
+}
+
+/* A copy of expr's code that EVAL can expand without touching expr --
+ * quoted data aside, since that's never expanded. */
+static sexpr *copy_code(sexpr *expr) {
+    sexpr *copy, *last, *cell;
+
+    if ((expr == NIL) || (expr->type != CONS) || ((expr->car->type == SYMBOL)
+                && (expr->car->symbol == QUOTE))) {
+        return expr;
+    }
+
+    copy = last = cons(copy_code(expr->car), NIL);
+    for (expr = expr->cdr; (expr != NIL) && (expr->type == CONS); expr = expr->cdr) {
+        cell = cons(copy_code(expr->car), NIL);
+        last->cdr = cell;
+        last = cell;
+    }
+    last->cdr = expr;
+
+    return copy;
+}
+
+/* A new list of argv's items. */
+static sexpr *list_of(int argc, sexpr *argv[]) {
+    sexpr *list = NIL;
+
+    while (argc-- > 0) {
+        list = cons(argv[argc], list);
+    }
+    return list;
+}
+
+static sexpr *quoted_t(void) {
+    return cons(slookup(QUOTE), cons(slookup(T), NIL));
+}
+
+/* (AND a b ...) => (COND (a (AND b ...))) */
+sexpr *expand_and(int argc, sexpr *argv[]) {
+    if (argc == 0) {
+        return quoted_t();
+    } else if (argc == 1) {
+        return argv[0];
+    }
+
+    return cons(slookup(COND),
+            cons(cons(argv[0], cons(cons(slookup(AND), list_of(argc - 1, argv + 1)), NIL)),
+                NIL));
+}
+
+/* (OR a b ...) => (COND (a 'T) ('T (OR b ...))) */
+sexpr *expand_or(int argc, sexpr *argv[]) {
+    sexpr *rest;
+
+    if (argc == 0) {
+        return NIL;
+    } else if (argc == 1) {
+        return argv[0];
+    }
+
+    rest = cons(quoted_t(), cons(cons(slookup(OR), list_of(argc - 1, argv + 1)), NIL));
+    return cons(slookup(COND),
+            cons(cons(argv[0], cons(quoted_t(), NIL)), cons(rest, NIL)));
+}
+
+/* (LET ((name value) ...) body) => ((LAMBDA (name ...) body) value ...) */
+sexpr *expand_let(int argc, sexpr *argv[]) {
+    sexpr *names = NIL, *values = NIL, *binding, *current;
+    sexpr **last_name = &names, **last_value = &values;
+
+    if (argc != 2) {
+        raise_eval_error("LET takes a list of bindings and a body.");
+    }
+
+    for (current = argv[0]; current != NIL; current = current->cdr) {
+        binding = (current->type == CONS) ? current->car : NIL;
+        if ((binding == NIL) || (binding->type != CONS)
+                || (binding->car == NIL) || (binding->car->type != SYMBOL)
+                || (binding->cdr == NIL) || (binding->cdr->type != CONS)) {
+            raise_eval_error("LET bindings look like (name value).");
+        }
+
+        *last_name = cons(binding->car, NIL);
+        last_name = &(*last_name)->cdr;
+        *last_value = cons(binding->cdr->car, NIL);
+        last_value = &(*last_value)->cdr;
+    }
+
+    return cons(cons(slookup(LAMBDA), cons(names, cons(argv[1], NIL))), values);
+}
+
+/* Adds every symbol in expr -- outside of QUOTE -- to found. */
+static void collect_symbols(sexpr *expr, bool *seen, l_symbol *found, size_t *count) {
+    if (expr == NIL) {
+        return;
+    }
+
+    if (expr->type == SYMBOL) {
+        if (!seen[expr->symbol]) {
+            seen[expr->symbol] = true;
+            found[(*count)++] = expr->symbol;
+        }
+        return;
+    }
+
+    if ((expr->type != CONS) || ((expr->car != NIL)
+                && (expr->car->type == SYMBOL) && (expr->car->symbol == QUOTE))) {
+        return;
+    }
+
+    for (; (expr != NIL) && (expr->type == CONS); expr = expr->cdr) {
+        collect_symbols(expr->car, seen, found, count);
+    }
+    /* The end of an improper list. */
+    collect_symbols(expr, seen, found, count);
+}
 
+/*
+ * The symbols a lambda's body may refer to, besides its formals. Worked
+ * out once per lambda expression and cached by its body's cell, until
+ * that cell is collected.
+ */
+static struct free_symbols *free_symbols_of(sexpr *formals, sexpr *body) {
+    struct free_symbols *symbols;
+    bool seen[MAX_NAMES] = { false };
+    l_symbol found[MAX_NAMES];
+    size_t count = 0, ignored = 0;
+
+    symbols = free_symbol_cache[body - heap];
+    if ((symbols != NULL) && (symbols->formals == formals)) {
+        return symbols;
+    }
+
+    /* The first time the lambda is seen; its body can only be trusted to
+     * say what it refers to once it's expanded. */
+    expand_macros(body);
+    symbols = free_symbol_cache[body - heap];
+
+    /* Formals are bound in the body, so they never need capturing. */
+    collect_symbols(formals, seen, found, &ignored);
+    collect_symbols(body, seen, found + ignored, &count);
+
+    free(symbols);
+    symbols = malloc(sizeof(*symbols) + count * sizeof(l_symbol));
+    assert(symbols != NULL);
+    symbols->formals = formals;
+    symbols->optimized = NULL;
+    symbols->epoch = 0;
+    memset(&symbols->jit, 0, sizeof(symbols->jit));
+    symbols->count = count;
+    memcpy(symbols->symbols, found + ignored, count * sizeof(l_symbol));
+
+    free_symbol_cache[body - heap] = symbols;
+    return symbols;
+}
+
+/* Returns the symbol's (symbol . value) pair in environment, or NULL. */
+static sexpr *find_binding(l_symbol symbol, sexpr *environment) {
+    sexpr *current, *pair;
+
+    for (current = environment; current != NIL; current = current->cdr) {
+        pair = current->car;
         if (pair->car->symbol == symbol) {
-            /* Symbol was found! */
-            return pair->cdr;
+            return pair;
         }
+    }
 
-        current = current->cdr;
+    return NULL;
+}
+
+/*
+ * A list of just the bindings from env that the body might use. Globals
+ * are left out: assoc() falls back to the global environment, so they're
+ * found wherever the closure is called from.
+ */
+static sexpr *capture_bindings(sexpr *formal_args, sexpr *body, sexpr *env) {
+    struct free_symbols *symbols;
+    sexpr *captured = NIL, *pair;
+    size_t i;
+
+    if ((env == NIL) || (env == global) || (body == NIL) || !IS_HEAP_CELL(body)) {
+        return NIL;
+    }
+
+    symbols = free_symbols_of(formal_args, body);
+    for (i = 0; i < symbols->count; i++) {
+        pair = find_binding(symbols->symbols[i], env);
+        if (pair != NULL) {
+            captured = cons(pair, captured);
+        }
+    }
+
+    return captured;
+}
+
+/*
+ * Partial evaluation.
+ *
+ * The first time create_lambda() meets a lambda expression, it makes a
+ * copy of the body with calls of pure built-ins on constants folded, COND
+ * clauses that can never be chosen dropped, and the names of built-ins in
+ * call position replaced by the built-ins themselves -- which saves a walk
+ * of the environment per call. The closure keeps the original body, and
+ * LABEL rebinding any initial symbol throws every copy out.
+ */
+
+/* Marks every symbol in the formals. */
+static void bind_formals(sexpr *formals, bool *bound) {
+    for (; (formals != NIL) && (formals->type == CONS); formals = formals->cdr) {
+        if ((formals->car != NIL) && (formals->car->type == SYMBOL)) {
+            bound[formals->car->symbol] = true;
+        }
+    }
+    /* A rest argument. */
+    if ((formals != NIL) && (formals->type == SYMBOL)) {
+        bound[formals->symbol] = true;
+    }
+}
+
+/* True if expr evaluates to the same thing every time. */
+static bool is_constant(sexpr *expr, bool *bound) {
+    if (expr == NIL) {
+        return true;
+    }
+
+    switch (expr->type) {
+        case NUMBER:
+        case STRING:
+            return true;
+        case SYMBOL:
+            return (expr->symbol == T) && !bound[T] && !redefined[T];
+        case CONS:
+            return (expr->car != NIL) && (expr->car->type == SYMBOL)
+                && (expr->car->symbol == QUOTE)
+                && (expr->cdr != NIL) && (expr->cdr->type == CONS);
+        default:
+            return false;
+    }
+}
+
+/* What a constant expression evaluates to. */
+static sexpr *constant_value(sexpr *expr) {
+    if ((expr != NIL) && (expr->type == CONS)) {
+        return expr->cdr->car;
+    } else if ((expr != NIL) && (expr->type == SYMBOL)) {
+        return slookup(T);
+    }
+    return expr;
+}
+
+/* An expression that evaluates to value. */
+static sexpr *quote_value(sexpr *value) {
+    if ((value == NIL) || (value->type == NUMBER) || (value->type == STRING)) {
+        return value;
+    }
+    return cons(slookup(QUOTE), cons(value, NIL));
+}
+
+/* The built-in that symbol names wherever this code runs, or symbol. */
+static sexpr *inline_builtin(sexpr *symbol, bool *bound) {
+    sexpr *pair;
+
+    if (bound[symbol->symbol] || redefined[symbol->symbol]) {
+        return symbol;
+    }
+
+    pair = find_binding(symbol->symbol, global);
+    if ((pair != NULL) && (pair->cdr != NIL)
+            && (pair->cdr->type == BUILT_IN_FUNCTION) && !pair->cdr->macro
+            && (pair->cdr->builtin_symbol == symbol->symbol)) {
+        return pair->cdr;
+    }
+    return symbol;
+}
+
+/* True if the built-in can't fail or have side-effects given these. */
+static bool is_foldable(l_symbol builtin, int argc, sexpr *argv[]) {
+    int i;
+
+    switch (builtin) {
+        case EQ:
+        case EQUAL:
+            return argc == 2;
+        case ATOM:
+        case S_NULL:
+        case NOT:
+            return argc == 1;
+        case CAR:
+        case CDR:
+            return (argc == 1) && (argv[0] != NIL) && (argv[0]->type == CONS);
+        case PLUS:
+        case NEG:
+        case MUL:
+        case DIV:
+        case LT:
+        case GT:
+            if ((builtin == NEG) && (argc < 1)) {
+                return false;
+            }
+            for (i = 0; i < argc; i++) {
+                if ((argv[i] == NIL) || (argv[i]->type != NUMBER)
+                        || ((builtin == DIV) && (argv[i]->number == 0))) {
+                    return false;
+                }
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+#define MAX_FOLDED_ARGS 8
+
+/* Calls the built-in now if all of its arguments are constant. */
+static sexpr *fold_call(sexpr *builtin, sexpr *args, bool *bound) {
+    sexpr *argv[MAX_FOLDED_ARGS];
+    sexpr *current;
+    int argc = 0;
+
+    for (current = args; current != NIL; current = current->cdr) {
+        if ((current->type != CONS) || (argc == MAX_FOLDED_ARGS)
+                || !is_constant(current->car, bound)) {
+            return NULL;
+        }
+        argv[argc++] = constant_value(current->car);
+    }
+
+    if (!is_foldable(builtin->builtin_symbol, argc, argv)) {
+        return NULL;
+    }
+    return quote_value(builtin->func(argc, argv));
+}
+
+static sexpr *partially_evaluate(sexpr *expr, bool *bound);
+
+/* Partially evaluates every element, sharing whatever didn't change. */
+static sexpr *partially_evaluate_list(sexpr *list, bool *bound) {
+    sexpr *first, *rest;
+
+    if ((list == NIL) || (list->type != CONS)) {
+        return list;
+    }
+
+    first = partially_evaluate(list->car, bound);
+    rest = partially_evaluate_list(list->cdr, bound);
+    if ((first == list->car) && (rest == list->cdr)) {
+        return list;
+    }
+    return cons(first, rest);
+}
+
+/* Drops clauses that can never be chosen, and any after one that always is. */
+static sexpr *fold_clauses(sexpr *clauses, bool *bound) {
+    sexpr *clause, *test, *rest;
+
+    if ((clauses == NIL) || (clauses->type != CONS)
+            || (clauses->car == NIL) || (clauses->car->type != CONS)) {
+        return clauses;
+    }
+
+    clause = clauses->car;
+    test = partially_evaluate(clause->car, bound);
+    if (!is_constant(test, bound)) {
+        rest = fold_clauses(clauses->cdr, bound);
+    } else if (is_truthy(constant_value(test))) {
+        rest = NIL;
+    } else {
+        return fold_clauses(clauses->cdr, bound);
+    }
+
+    clause = cons(test, partially_evaluate_list(clause->cdr, bound));
+    return cons(clause, rest);
+}
+
+static sexpr *fold_cond(sexpr *expr, bool *bound) {
+    sexpr *clauses = fold_clauses(expr->cdr, bound);
+    sexpr *first;
+
+    if (clauses == NIL) {
+        /* No clause can be chosen. */
+        return NIL;
+    }
+
+    first = (clauses->type == CONS) ? clauses->car : NIL;
+    if ((first != NIL) && (first->type == CONS)
+            && is_constant(first->car, bound)
+            && (first->cdr != NIL) && (first->cdr->type == CONS)) {
+        /* The first clause is always chosen. */
+        return first->cdr->car;
+    }
+    return cons(expr->car, clauses);
+}
+
+static sexpr *partially_evaluate_lambda(sexpr *expr, bool *outer) {
+    bool bound[MAX_NAMES];
+    sexpr *rest = expr->cdr, *body;
+
+    if ((rest == NIL) || (rest->type != CONS)
+            || (rest->cdr == NIL) || (rest->cdr->type != CONS)) {
+        return expr;
+    }
+
+    memcpy(bound, outer, sizeof(bound));
+    bind_formals(rest->car, bound);
+
+    body = partially_evaluate_list(rest->cdr, bound);
+    if (body == rest->cdr) {
+        return expr;
+    }
+    return cons(expr->car, cons(rest->car, body));
+}
+
+/* A copy of expr that does less work, given the symbols bound around it. */
+static sexpr *partially_evaluate(sexpr *expr, bool *bound) {
+    sexpr *head, *operator, *args, *folded;
+
+    if ((expr == NIL) || (expr->type != CONS)) {
+        return expr;
+    }
+
+    head = expr->car;
+    if ((head != NIL) && (head->type == SYMBOL) && is_special_form(head->symbol)) {
+        switch (head->symbol) {
+            case COND:
+                return fold_cond(expr, bound);
+            case LAMBDA:
+                return partially_evaluate_lambda(expr, bound);
+            case LABEL:
+                if ((expr->cdr == NIL) || (expr->cdr->type != CONS)) {
+                    return expr;
+                }
+                args = partially_evaluate_list(expr->cdr->cdr, bound);
+                if (args == expr->cdr->cdr) {
+                    return expr;
+                }
+                return cons(head, cons(expr->cdr->car, args));
+            case TIME:
+                args = partially_evaluate_list(expr->cdr, bound);
+                return (args == expr->cdr) ? expr : cons(head, args);
+            default:
+                return expr;
+        }
+    }
+
+    if ((head != NIL) && (head->type == SYMBOL)) {
+        operator = inline_builtin(head, bound);
+    } else {
+        operator = partially_evaluate(head, bound);
+    }
+    args = partially_evaluate_list(expr->cdr, bound);
+
+    if ((operator != NIL) && (operator->type == BUILT_IN_FUNCTION)) {
+        folded = fold_call(operator, args, bound);
+        if (folded != NULL) {
+            return folded;
+        }
+    }
+
+    if ((operator == head) && (args == expr->cdr)) {
+        return expr;
+    }
+    return cons(operator, args);
+}
+
+/* Makes the optimized copy of body, unless there's an up-to-date one. */
+static void optimize_lambda(sexpr *formal_args, sexpr *body, sexpr *env) {
+    bool bound[MAX_NAMES] = { false };
+    struct free_symbols *info;
+    sexpr *current;
+
+    if ((body == NIL) || !IS_HEAP_CELL(body)) {
+        return;
+    }
+
+    info = free_symbols_of(formal_args, body);
+    if (info->epoch == optimization_epoch) {
+        return;
+    }
+
+    bind_formals(formal_args, bound);
+    for (current = env; (current != NIL) && (current != global); current = current->cdr) {
+        bound[current->car->car->symbol] = true;
+    }
+
+    info->optimized = partially_evaluate(body, bound);
+    info->epoch = optimization_epoch;
+}
+
+/* The body to evaluate when func is called. */
+static sexpr *closure_body(sexpr *func) {
+    struct free_symbols *info;
+
+    if ((func->car == NIL) || !IS_HEAP_CELL(func->car)) {
+        return func->car;
+    }
+
+    info = free_symbol_cache[func->car - heap];
+    if ((info != NULL) && (info->formals == func->cdr->car)
+            && (info->epoch == optimization_epoch)) {
+        return info->optimized;
+    }
+    return func->car;
+}
+
+/**
+ * Lambdas are actually just cons cells.
+ *
+ * (body . (formal-arguments . captured-bindings))
+ *
+ * For example, the inner lambda in this expression:
+ *      (lambda (a b) (lambda (m) (m a b)))
+ *
+ * Is:
+ *      ((m a b) . ((m) . ((b . BOUND-B) (a . BOUND-A))))
+ *
+ * Only the bindings the body might use are captured, and the very same
+ * binding pairs are shared, so a closure keeps nothing else alive.
+ */
+static sexpr* create_lambda(sexpr *formal_args, sexpr *body, sexpr *env) {
+    sexpr *lambda = cons(body, cons(formal_args, capture_bindings(formal_args, body, env)));
+    lambda->type = FUNCTION;
+    lambda->macro = false;
+    closure_names[lambda - heap] = 0;
+    compiled_closures[lambda - heap] = NULL;
+    optimize_lambda(formal_args, body, env);
+
+    return lambda;
+}
+
+
+/* Returns the first expression that is associated with the symbol in the
+ * given environment -- or, failing that, in the global environment. */
+sexpr* assoc(l_symbol symbol, sexpr *environment) {
+    sexpr *pair;
+
+    if (environment == NIL) {
+        environment = global;
+    }
+
+    pair = find_binding(symbol, environment);
+    if ((pair == NULL) && (environment != global)) {
+        pair = find_binding(symbol, global);
+    }
+    if (pair != NULL) {
+        return pair->cdr;
     }
 
     fprintf(stderr, "Undefined symbol: %s\n", lookup(symbol));
@@ -1096,7 +3297,7 @@ sexpr *wrapped_eval(int n, sexpr *args[]) {
     if (n != 1) {
         raise_eval_error("eval takes exactly one argument.");
     }
-    return eval(args[0], global);
+    return eval(copy_code(args[0]), global);
 }
 
 sexpr* null(int n, sexpr *argv[]) {
@@ -1218,12 +3419,41 @@ sexpr *var_div(int argc, sexpr *argv[]) {
     return new_number(result);
 }
 
+/* True when every pair of adjacent arguments is in the given order. */
+static sexpr *compare(int argc, sexpr *argv[], bool less) {
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        if ((argv[i] == NIL) || (argv[i]->type != NUMBER)) {
+            raise_eval_error("Comparison given non-numeric arguments.");
+        }
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (less ? !(argv[i - 1]->number < argv[i]->number)
+                 : !(argv[i - 1]->number > argv[i]->number)) {
+            return NIL;
+        }
+    }
+
+    return to_lisp_boolean(true);
+}
+
+sexpr *less_than(int argc, sexpr *argv[]) {
+    return compare(argc, argv, true);
+}
+
+sexpr *greater_than(int argc, sexpr *argv[]) {
+    return compare(argc, argv, false);
+}
+
 
 
 struct builtin_func_def {
     l_symbol identifier;
     l_builtin func;
     int arity;
+    bool macro; /* Given its arguments unevaluated, returns the expansion. */
 };
 
 #define VARIABLE_ARITY -1
@@ -1256,6 +3486,7 @@ SIMPLE_WRAPPER_1(car)
 SIMPLE_WRAPPER_1(cdr)
 
 SIMPLE_WRAPPER_2(eq)
+SIMPLE_WRAPPER_2(equal)
 SIMPLE_WRAPPER_1(atom)
 
 /* Force a garbage collection. */
@@ -1264,45 +3495,4373 @@ sexpr *gc(int n, sexpr *args[]) {
     return NIL;
 }
 
+/* Prepends (name . value) to the association list. */
+static sexpr *stat_entry(char *name, sexpr *value, sexpr *alist) {
+    sexpr *key = slookup(insert_symbol(name));
+    return cons(cons(key, value), alist);
+}
 
-static struct builtin_func_def BUILT_INS[] = {
-    { EVAL, wrapped_eval, 2 },
-    { APPLY, wrapped_apply, 2 },
-
-    { S_CONS, wrapped_cons, 2 },
-    { CAR, wrapped_car, 1 },
-    { CDR, wrapped_cdr, 1 },
-
-    { EQ, wrapped_eq, 1 },
-    { S_NULL, null, 1 },
-    { ATOM, wrapped_atom, 1 },
-    { NOT, not, 1 },
-
-    { PLUS, plus, VARIABLE_ARITY },
-    { MUL, mul, VARIABLE_ARITY },
-    { NEG, sub, VARIABLE_ARITY },
-    { DIV, var_div, VARIABLE_ARITY },
-    { GC, gc, 0 },
-};
+/*
+ * (GC-STATS) returns the collector's and allocator's counters as an
+ * association list. Pause times are in seconds; HISTOGRAM is the list of
+ * free-list exhaustion counts by allocations since the last one, in
+ * power-of-two buckets.
+ */
+sexpr *gc_stats(int n, sexpr *args[]) {
+    sexpr *alist = NIL, *histogram = NIL;
+    int i = HISTOGRAM_BUCKETS;
 
+    while ((i > 0) && (stats.exhaustion_histogram[i - 1] == 0)) {
+        i--;
+    }
+    while (i-- > 0) {
+        histogram = cons(new_number(stats.exhaustion_histogram[i]), histogram);
+    }
+
+    alist = stat_entry("HISTOGRAM", histogram, alist);
+    alist = stat_entry("EXHAUSTIONS", new_number(stats.exhaustions), alist);
+    alist = stat_entry("PAUSE-MAX", new_number(stats.pause_max), alist);
+    alist = stat_entry("PAUSE-TOTAL", new_number(stats.pause_total), alist);
+    alist = stat_entry("HEAP-SIZE", new_number(HEAP_SIZE), alist);
+    alist = stat_entry("FREE", new_number(free_cell_count), alist);
+    alist = stat_entry("LIVE", new_number(stats.live_cells), alist);
+    alist = stat_entry("FREED", new_number(stats.cells_freed), alist);
+    alist = stat_entry("ALLOCATED", new_number(stats.cells_allocated), alist);
+    alist = stat_entry("COLLECTIONS", new_number(stats.collections), alist);
+
+    return alist;
+}
+
+
+
+/* Ports. */
+
+/* Big enough that reading a data file is never dominated by syscalls. */
+#define PORT_BUFFER_SIZE    (64 * 1024)
+
+sexpr *new_port(FILE *stream) {
+    sexpr *port = new_cell();
+    port->type = PORT;
+    port->stream = stream;
+    return port;
+}
+
+/*
+ * Opens the file named by a string, or by the n-th command line argument.
+ */
+static sexpr *open_file_argument(int n, sexpr *argv[], const char *mode) {
+    FILE *stream;
+    char path[PATH_MAX];
+    const char *name = path;
+    size_t length;
+    int index;
+
+    if ((n != 1) || (argv[0] == NIL)
+            || ((argv[0]->type != NUMBER) && (argv[0]->type != STRING))) {
+        raise_eval_error("Ports are opened by file name or command line argument number.");
+    }
+
+    if (argv[0]->type == STRING) {
+        length = string_length_of(argv[0]);
+        if ((length == 0) || (length >= sizeof(path))
+                || (memchr(string_bytes(argv[0]), '\0', length) != NULL)) {
+            raise_eval_error("Not a file name.");
+        }
+        memcpy(path, string_bytes(argv[0]), length);
+        path[length] = '\0';
+    } else {
+        index = (int) argv[0]->number;
+        if ((index < 1) || (index >= file_argc)) {
+            raise_eval_error("No such command line argument.");
+        }
+        name = file_argv[index];
+    }
+
+    stream = fopen(name, mode);
+    if (stream == NULL) {
+        fprintf(stderr, "Could not open %s\n", name);
+        longjmp(top_level_exception, EVAL_ERROR);
+    }
+    setvbuf(stream, NULL, _IOFBF, PORT_BUFFER_SIZE);
+
+    return new_port(stream);
+}
+
+/* (OPEN-INPUT file) opens a file, named by a string or by the number of
+ * a command line argument. */
+sexpr *open_input(int n, sexpr *argv[]) {
+    return open_file_argument(n, argv, "r");
+}
+
+/* (OPEN-OUTPUT file) truncates a file named the same way. */
+sexpr *open_output(int n, sexpr *argv[]) {
+    return open_file_argument(n, argv, "w");
+}
+
+static FILE *port_stream(sexpr *port) {
+    if ((port == NIL) || (port->type != PORT)) {
+        fprintf(stderr, "Expected a port.\n");
+        longjmp(top_level_exception, EVAL_ERROR);
+    }
+    if (port->stream == NULL) {
+        fprintf(stderr, "Port is closed.\n");
+        longjmp(top_level_exception, EVAL_ERROR);
+    }
+    return port->stream;
+}
+
+/* (READ [port]) reads the next datum, or #EOF. Reads stdin by default. */
+sexpr *wrapped_read(int n, sexpr *argv[]) {
+    if (n == 0) {
+        flush_output();
+        return share_tree(l_read_from(stdin));
+    } else if (n == 1) {
+        return share_tree(l_read_from(port_stream(argv[0])));
+    }
+    raise_eval_error("read takes at most one argument.");
+}
+
+sexpr *is_eof(int n, sexpr *argv[]) {
+    if (n != 1) {
+        raise_eval_error("eof? takes exactly one argument.");
+    }
+    return to_lisp_boolean(argv[0] == EOF_OBJECT);
+}
+
+/* Closes the port right away instead of waiting for the collector. */
+sexpr *close_port(int n, sexpr *argv[]) {
+    if (n != 1) {
+        raise_eval_error("close takes exactly one argument.");
+    }
+
+    FILE *stream = port_stream(argv[0]);
+    if (stream != stdin) {
+        fclose(stream);
+    }
+    argv[0]->stream = NULL;
+
+    return NIL;
+}
+
+
+
+/*
+ * Hash tables.
+ *
+ * Keys are compared as EQ compares them: numbers and symbols by value,
+ * anything else by identity. Slots live in one malloc()ed block, probed
+ * linearly; each caches its key's hash so that most mismatches never
+ * touch the key's cell. The collector traces them through gray_cells.
+ */
+
+#define HASH_MIN_CAPACITY   8
+
+/* Marks a slot whose entry was deleted; probing continues past it. */
+static sexpr deleted_key;
+#define DELETED_KEY (&deleted_key)
+
+#define slot_in_use(slot) (((slot)->key != NULL) && ((slot)->key != DELETED_KEY))
+
+static uint64_t mix_bits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ULL;
+    bits ^= bits >> 33;
+    return bits;
+}
+
+static uint64_t hash_string(sexpr *string);
+
+static uint64_t hash_key(sexpr *key) {
+    uint64_t bits;
+    l_number number;
+
+    switch (key->type) {
+        case NUMBER:
+            /* 0 and -0 are EQ, so they had better hash alike. */
+            number = (key->number == 0) ? 0 : key->number;
+            memcpy(&bits, &number, sizeof(bits));
+            return mix_bits(bits);
+        case SYMBOL:
+            return mix_bits(key->symbol);
+        case STRING:
+            return hash_string(key);
+        case CONS:
+            /* Never EQ to anything, so it could never be found again. */
+            fprintf(stderr, "Lists can't be hash keys.\n");
+            longjmp(top_level_exception, EVAL_ERROR);
+        default:
+            return mix_bits((uintptr_t) key);
+    }
+}
+
+static struct hash_table *allocate_table(size_t capacity) {
+    struct hash_table *table;
+
+    table = calloc(1, sizeof(*table) + capacity * sizeof(struct hash_slot));
+    assert(table != NULL);
+    table->capacity = capacity;
+
+    return table;
+}
+
+/* Finds key's slot or, failing that, the slot it should be put in. */
+static struct hash_slot *find_slot(struct hash_table *table, sexpr *key, uint64_t hash) {
+    size_t mask = table->capacity - 1, i;
+    struct hash_slot *slot, *deleted = NULL;
+
+    for (i = hash & mask; ; i = (i + 1) & mask) {
+        slot = &table->slots[i];
+
+        if (slot->key == NULL) {
+            return (deleted != NULL) ? deleted : slot;
+        } else if (slot->key == DELETED_KEY) {
+            if (deleted == NULL) {
+                deleted = slot;
+            }
+        } else if ((slot->hash == hash) && c_eq(slot->key, key)) {
+            return slot;
+        }
+    }
+}
+
+/* Rehashes into a table with room for at least one more entry. */
+static void grow_table(sexpr *cell) {
+    struct hash_table *old = cell->table, *table;
+    size_t capacity = old->capacity, i;
+    struct hash_slot *slot;
+
+    /* Grow if it's really filling up; otherwise just sweep out the
+     * deleted slots. */
+    if ((old->count + 1) * 2 > capacity) {
+        capacity *= 2;
+    }
+
+    table = allocate_table(capacity);
+    for (i = 0; i < old->capacity; i++) {
+        if (slot_in_use(&old->slots[i])) {
+            slot = find_slot(table, old->slots[i].key, old->slots[i].hash);
+            *slot = old->slots[i];
+        }
+    }
+    table->count = table->used = old->count;
+
+    cell->table = table;
+    free(old);
+}
+
+static int mark_table(struct hash_table *table) {
+    int count = 0;
+    size_t i;
+
+    for (i = 0; i < table->capacity; i++) {
+        if (slot_in_use(&table->slots[i])) {
+            count += mark_root(table->slots[i].key);
+            count += mark_root(table->slots[i].value);
+        }
+    }
+
+    return count;
+}
+
+static sexpr *table_argument(sexpr *cell) {
+    if ((cell == NIL) || (cell->type != HASH_TABLE)) {
+        fprintf(stderr, "Expected a hash table.\n");
+        longjmp(top_level_exception, EVAL_ERROR);
+    }
+    return cell;
+}
+
+/* (MAKE-HASH [size]) makes an empty table with room for size entries. */
+sexpr *make_hash(int n, sexpr *argv[]) {
+    size_t capacity = HASH_MIN_CAPACITY;
+    sexpr *cell;
+
+    if (n > 1) {
+        raise_eval_error("make-hash takes at most one argument.");
+    }
+    if (n == 1) {
+        if (argv[0]->type != NUMBER) {
+            raise_eval_error("make-hash: size must be a number.");
+        }
+        /* Keep it no more than three-quarters full. */
+        while (capacity * 3 < argv[0]->number * 4) {
+            capacity *= 2;
+        }
+    }
+
+    cell = new_cell();
+    cell->type = HASH_TABLE;
+    cell->table = allocate_table(capacity);
+
+    return cell;
+}
+
+/* (HASH-GET table key [default]) */
+sexpr *hash_get(int n, sexpr *argv[]) {
+    struct hash_slot *slot;
+
+    if ((n != 2) && (n != 3)) {
+        raise_eval_error("hash-get takes a table, a key and maybe a default.");
+    }
+
+    slot = find_slot(table_argument(argv[0])->table, argv[1], hash_key(argv[1]));
+    if (slot_in_use(slot)) {
+        return slot->value;
+    }
+    return (n == 3) ? argv[2] : NIL;
+}
+
+/* (HASH-PUT table key value) returns value. */
+sexpr *hash_put(int n, sexpr *argv[]) {
+    sexpr *cell;
+    struct hash_slot *slot;
+    uint64_t hash;
+
+    if (n != 3) {
+        raise_eval_error("hash-put takes a table, a key and a value.");
+    }
+
+    cell = table_argument(argv[0]);
+    hash = hash_key(argv[1]);
+    slot = find_slot(cell->table, argv[1], hash);
+
+    if (!slot_in_use(slot)) {
+        if ((slot->key == NULL) && ((cell->table->used + 1) * 4 > cell->table->capacity * 3)) {
+            grow_table(cell);
+            slot = find_slot(cell->table, argv[1], hash);
+        }
+        if (slot->key == NULL) {
+            cell->table->used++;
+        }
+        cell->table->count++;
+        slot->hash = hash;
+        slot->key = argv[1];
+    }
+    slot->value = argv[2];
+
+    return argv[2];
+}
+
+/* (HASH-DEL table key) returns T if there was such a key. */
+sexpr *hash_del(int n, sexpr *argv[]) {
+    struct hash_table *table;
+    struct hash_slot *slot;
+
+    if (n != 2) {
+        raise_eval_error("hash-del takes a table and a key.");
+    }
+
+    table = table_argument(argv[0])->table;
+    slot = find_slot(table, argv[1], hash_key(argv[1]));
+    if (!slot_in_use(slot)) {
+        return NIL;
+    }
+
+    slot->key = DELETED_KEY;
+    slot->value = NULL;
+    table->count--;
+
+    return to_lisp_boolean(true);
+}
+
+/* (HASH-KEYS table) lists the keys, in no particular order. */
+sexpr *hash_keys(int n, sexpr *argv[]) {
+    sexpr *keys = NIL;
+    size_t i;
+
+    if (n != 1) {
+        raise_eval_error("hash-keys takes exactly one table.");
+    }
+
+    /* The table itself is in argv, so it's safe from the collector; cons()
+     * can't move or free it. */
+    table_argument(argv[0]);
+    for (i = 0; i < argv[0]->table->capacity; i++) {
+        if (slot_in_use(&argv[0]->table->slots[i])) {
+            keys = cons(argv[0]->table->slots[i].key, keys);
+        }
+    }
+
+    return keys;
+}
+
+sexpr *hash_count(int n, sexpr *argv[]) {
+    if (n != 1) {
+        raise_eval_error("hash-count takes exactly one table.");
+    }
+    return new_number(table_argument(argv[0])->table->count);
+}
+
+
+
+
+/*
+ * Vectors.
+ *
+ * A vector's items are one malloc()ed array of cell pointers, so indexing
+ * is constant-time and each item costs one pointer rather than a whole
+ * cons cell. Like hash tables, vectors are traced through gray_cells.
+ */
+
+static int mark_vector(struct vector *vector) {
+    int count = 0;
+    size_t i;
+
+    for (i = 0; i < vector->length; i++) {
+        count += mark_root(vector->items[i]);
+    }
+
+    return count;
+}
+
+static struct vector *allocate_vector(size_t length) {
+    struct vector *vector;
+
+    vector = malloc(sizeof(*vector) + length * sizeof(sexpr *));
+    assert(vector != NULL);
+    vector->length = length;
+
+    return vector;
+}
+
+static sexpr *vector_argument(sexpr *cell) {
+    if ((cell == NIL) || (cell->type != VECTOR)) {
+        fprintf(stderr, "Expected a vector.\n");
+        longjmp(top_level_exception, EVAL_ERROR);
+    }
+    return cell;
+}
+
+/* Checks that index is a whole number that indexes the vector. */
+static size_t vector_index(sexpr *vector, sexpr *index) {
+    if ((index == NIL) || (index->type != NUMBER)
+            || (index->number < 0) || (index->number >= vector->vector->length)
+            || (index->number != (size_t) index->number)) {
+        fprintf(stderr, "Vector index out of range.\n");
+        longjmp(top_level_exception, EVAL_ERROR);
+    }
+    return index->number;
+}
+
+/* (MAKE-VECTOR length [fill]); fill defaults to NIL. */
+sexpr *make_vector(int n, sexpr *argv[]) {
+    sexpr *cell, *fill;
+    size_t length, i;
+
+    if ((n != 1) && (n != 2)) {
+        raise_eval_error("make-vector takes a length and maybe a fill.");
+    }
+    if ((argv[0]->type != NUMBER) || (argv[0]->number < 0)
+            || (argv[0]->number > SIZE_MAX / sizeof(sexpr *))
+            || (argv[0]->number != (size_t) argv[0]->number)) {
+        raise_eval_error("make-vector: length must be a whole number.");
+    }
+
+    length = argv[0]->number;
+    fill = (n == 2) ? argv[1] : NIL;
+
+    cell = new_cell();
+    cell->type = VECTOR;
+    cell->vector = allocate_vector(length);
+    for (i = 0; i < length; i++) {
+        cell->vector->items[i] = fill;
+    }
+
+    return cell;
+}
+
+sexpr *vector_ref(int n, sexpr *argv[]) {
+    if (n != 2) {
+        raise_eval_error("vector-ref takes a vector and an index.");
+    }
+    vector_argument(argv[0]);
+    return argv[0]->vector->items[vector_index(argv[0], argv[1])];
+}
+
+/* (VECTOR-SET! vector index value) returns value. */
+sexpr *vector_set(int n, sexpr *argv[]) {
+    if (n != 3) {
+        raise_eval_error("vector-set! takes a vector, an index and a value.");
+    }
+    vector_argument(argv[0]);
+    argv[0]->vector->items[vector_index(argv[0], argv[1])] = argv[2];
+    return argv[2];
+}
+
+sexpr *vector_length(int n, sexpr *argv[]) {
+    if (n != 1) {
+        raise_eval_error("vector-length takes exactly one vector.");
+    }
+    return new_number(vector_argument(argv[0])->vector->length);
+}
+
+
+
+
+/*
+ * Float64 arrays.
+ *
+ * Unboxed l_numbers in one malloc()ed block: nothing in them for the
+ * collector to trace, and arithmetic on whole arrays never allocates a
+ * cell per element. The kernels come in scalar, SSE2 and AVX2 flavours;
+ * the best one the CPU supports is picked the first time one is needed.
+ * The vector kernels sum in a different order than the scalar ones, so
+ * F64-SUM and F64-DOT may differ in the last few bits between machines.
+ */
+
+enum f64_operator { OP_ADD, OP_SUB, OP_MUL, OP_DIV };
+
+struct f64_kernels {
+    /* out[i] = a[i] op b[i] */
+    void (*elementwise)(enum f64_operator op, const l_number *a,
+            const l_number *b, l_number *out, size_t n);
+    /* out[i] = a[i] * k */
+    void (*scale)(const l_number *a, l_number k, l_number *out, size_t n);
+    l_number (*dot)(const l_number *a, const l_number *b, size_t n);
+    l_number (*sum)(const l_number *a, size_t n);
+    /* Smallest or largest of a[0..n), n > 0. */
+    l_number (*extreme)(bool largest, const l_number *a, size_t n);
+};
+
+/* The scalar kernels do whatever is left after [from, n). */
+
+static void elementwise_from(size_t from, enum f64_operator op,
+        const l_number *a, const l_number *b, l_number *out, size_t n) {
+    size_t i;
+
+    for (i = from; i < n; i++) {
+        switch (op) {
+            case OP_ADD: out[i] = a[i] + b[i]; break;
+            case OP_SUB: out[i] = a[i] - b[i]; break;
+            case OP_MUL: out[i] = a[i] * b[i]; break;
+            case OP_DIV: out[i] = a[i] / b[i]; break;
+        }
+    }
+}
+
+static void scale_from(size_t from, const l_number *a, l_number k,
+        l_number *out, size_t n) {
+    for (size_t i = from; i < n; i++) {
+        out[i] = a[i] * k;
+    }
+}
+
+static l_number dot_from(size_t from, const l_number *a, const l_number *b, size_t n) {
+    l_number total = 0;
+    for (size_t i = from; i < n; i++) {
+        total += a[i] * b[i];
+    }
+    return total;
+}
+
+static l_number sum_from(size_t from, const l_number *a, size_t n) {
+    l_number total = 0;
+    for (size_t i = from; i < n; i++) {
+        total += a[i];
+    }
+    return total;
+}
+
+static l_number extreme_from(size_t from, bool largest, l_number best,
+        const l_number *a, size_t n) {
+    for (size_t i = from; i < n; i++) {
+        if (largest ? (a[i] > best) : (a[i] < best)) {
+            best = a[i];
+        }
+    }
+    return best;
+}
+
+static void elementwise_scalar(enum f64_operator op, const l_number *a,
+        const l_number *b, l_number *out, size_t n) {
+    elementwise_from(0, op, a, b, out, n);
+}
+
+static void scale_scalar(const l_number *a, l_number k, l_number *out, size_t n) {
+    scale_from(0, a, k, out, n);
+}
+
+static l_number dot_scalar(const l_number *a, const l_number *b, size_t n) {
+    return dot_from(0, a, b, n);
+}
+
+static l_number sum_scalar(const l_number *a, size_t n) {
+    return sum_from(0, a, n);
+}
+
+static l_number extreme_scalar(bool largest, const l_number *a, size_t n) {
+    return extreme_from(1, largest, a[0], a, n);
+}
+
+static const struct f64_kernels scalar_kernels = {
+    elementwise_scalar, scale_scalar, dot_scalar, sum_scalar, extreme_scalar
+};
+
+#ifdef __SSE2__
+static void elementwise_sse2(enum f64_operator op, const l_number *a,
+        const l_number *b, l_number *out, size_t n) {
+    size_t i = 0;
+    __m128d x, y;
+
+    for (; i + 2 <= n; i += 2) {
+        x = _mm_loadu_pd(a + i);
+        y = _mm_loadu_pd(b + i);
+        switch (op) {
+            case OP_ADD: x = _mm_add_pd(x, y); break;
+            case OP_SUB: x = _mm_sub_pd(x, y); break;
+            case OP_MUL: x = _mm_mul_pd(x, y); break;
+            case OP_DIV: x = _mm_div_pd(x, y); break;
+        }
+        _mm_storeu_pd(out + i, x);
+    }
+    elementwise_from(i, op, a, b, out, n);
+}
+
+static void scale_sse2(const l_number *a, l_number k, l_number *out, size_t n) {
+    __m128d factor = _mm_set1_pd(k);
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), factor));
+    }
+    scale_from(i, a, k, out, n);
+}
+
+static l_number horizontal_sum_sse2(__m128d x) {
+    double lanes[2];
+    _mm_storeu_pd(lanes, x);
+    return lanes[0] + lanes[1];
+}
+
+static l_number dot_sse2(const l_number *a, const l_number *b, size_t n) {
+    __m128d total = _mm_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2) {
+        total = _mm_add_pd(total, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    return horizontal_sum_sse2(total) + dot_from(i, a, b, n);
+}
+
+static l_number sum_sse2(const l_number *a, size_t n) {
+    __m128d total = _mm_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2) {
+        total = _mm_add_pd(total, _mm_loadu_pd(a + i));
+    }
+    return horizontal_sum_sse2(total) + sum_from(i, a, n);
+}
+
+static l_number extreme_sse2(bool largest, const l_number *a, size_t n) {
+    __m128d best;
+    double lanes[2];
+    size_t i = 2;
+
+    if (n < 2) {
+        return a[0];
+    }
+
+    best = _mm_loadu_pd(a);
+    for (; i + 2 <= n; i += 2) {
+        best = largest ? _mm_max_pd(best, _mm_loadu_pd(a + i))
+                       : _mm_min_pd(best, _mm_loadu_pd(a + i));
+    }
+    _mm_storeu_pd(lanes, best);
+    return extreme_from(i, largest, extreme_from(1, largest, lanes[0], lanes, 2), a, n);
+}
+
+static const struct f64_kernels sse2_kernels = {
+    elementwise_sse2, scale_sse2, dot_sse2, sum_sse2, extreme_sse2
+};
+#endif /* __SSE2__ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AVX2 __attribute__((target("avx2")))
+
+static AVX2 void elementwise_avx2(enum f64_operator op, const l_number *a,
+        const l_number *b, l_number *out, size_t n) {
+    size_t i = 0;
+    __m256d x, y;
+
+    for (; i + 4 <= n; i += 4) {
+        x = _mm256_loadu_pd(a + i);
+        y = _mm256_loadu_pd(b + i);
+        switch (op) {
+            case OP_ADD: x = _mm256_add_pd(x, y); break;
+            case OP_SUB: x = _mm256_sub_pd(x, y); break;
+            case OP_MUL: x = _mm256_mul_pd(x, y); break;
+            case OP_DIV: x = _mm256_div_pd(x, y); break;
+        }
+        _mm256_storeu_pd(out + i, x);
+    }
+    elementwise_from(i, op, a, b, out, n);
+}
+
+static AVX2 void scale_avx2(const l_number *a, l_number k, l_number *out, size_t n) {
+    __m256d factor = _mm256_set1_pd(k);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), factor));
+    }
+    scale_from(i, a, k, out, n);
+}
+
+static AVX2 l_number horizontal_sum_avx2(__m256d x) {
+    double lanes[4];
+    _mm256_storeu_pd(lanes, x);
+    return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+static AVX2 l_number dot_avx2(const l_number *a, const l_number *b, size_t n) {
+    __m256d total = _mm256_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        total = _mm256_add_pd(total,
+                _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    return horizontal_sum_avx2(total) + dot_from(i, a, b, n);
+}
+
+static AVX2 l_number sum_avx2(const l_number *a, size_t n) {
+    __m256d total = _mm256_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        total = _mm256_add_pd(total, _mm256_loadu_pd(a + i));
+    }
+    return horizontal_sum_avx2(total) + sum_from(i, a, n);
+}
+
+static AVX2 l_number extreme_avx2(bool largest, const l_number *a, size_t n) {
+    __m256d best;
+    double lanes[4];
+    size_t i = 4;
+
+    if (n < 4) {
+        return extreme_scalar(largest, a, n);
+    }
+
+    best = _mm256_loadu_pd(a);
+    for (; i + 4 <= n; i += 4) {
+        best = largest ? _mm256_max_pd(best, _mm256_loadu_pd(a + i))
+                       : _mm256_min_pd(best, _mm256_loadu_pd(a + i));
+    }
+    _mm256_storeu_pd(lanes, best);
+    return extreme_from(i, largest, extreme_scalar(largest, lanes, 4), a, n);
+}
+
+static const struct f64_kernels avx2_kernels = {
+    elementwise_avx2, scale_avx2, dot_avx2, sum_avx2, extreme_avx2
+};
+#endif
+
+static const struct f64_kernels *kernels(void) {
+    static const struct f64_kernels *best = NULL;
+
+    if (best == NULL) {
+        best = &scalar_kernels;
+#ifdef __SSE2__
+        best = &sse2_kernels;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("avx2")) {
+            best = &avx2_kernels;
+        }
+#endif
+    }
+
+    return best;
+}
+
+static sexpr *new_f64_array(size_t length) {
+    sexpr *cell = new_cell();
+
+    cell->type = F64_ARRAY;
+    cell->f64 = malloc(sizeof(struct f64_array) + length * sizeof(l_number));
+    assert(cell->f64 != NULL);
+    cell->f64->length = length;
+
+    return cell;
+}
+
+static struct f64_array *f64_argument(sexpr *cell) {
+    if ((cell == NIL) || (cell->type != F64_ARRAY)) {
+        fprintf(stderr, "Expected a float64 array.\n");
+        longjmp(top_level_exception, EVAL_ERROR);
+    }
+    return cell->f64;
+}
+
+static l_number number_argument(sexpr *cell) {
+    if ((cell == NIL) || (cell->type != NUMBER)) {
+        fprintf(stderr, "Expected a number.\n");
+        longjmp(top_level_exception, EVAL_ERROR);
+    }
+    return cell->number;
+}
+
+static size_t f64_index(struct f64_array *array, sexpr *index) {
+    if ((index == NIL) || (index->type != NUMBER)
+            || (index->number < 0) || (index->number >= array->length)
+            || (index->number != (size_t) index->number)) {
+        fprintf(stderr, "Array index out of range.\n");
+        longjmp(top_level_exception, EVAL_ERROR);
+    }
+    return index->number;
+}
+
+/* (MAKE-F64 length [fill]); fill defaults to 0. */
+sexpr *make_f64(int n, sexpr *argv[]) {
+    l_number fill = 0;
+    sexpr *cell;
+    size_t i;
+
+    if ((n != 1) && (n != 2)) {
+        raise_eval_error("make-f64 takes a length and maybe a fill.");
+    }
+    if ((argv[0]->type != NUMBER) || (argv[0]->number < 0)
+            || (argv[0]->number > SIZE_MAX / sizeof(l_number))
+            || (argv[0]->number != (size_t) argv[0]->number)) {
+        raise_eval_error("make-f64: length must be a whole number.");
+    }
+    if (n == 2) {
+        fill = number_argument(argv[1]);
+    }
+
+    cell = new_f64_array(argv[0]->number);
+    for (i = 0; i < cell->f64->length; i++) {
+        cell->f64->items[i] = fill;
+    }
+
+    return cell;
+}
+
+sexpr *f64_ref(int n, sexpr *argv[]) {
+    struct f64_array *array;
+
+    if (n != 2) {
+        raise_eval_error("f64-ref takes an array and an index.");
+    }
+    array = f64_argument(argv[0]);
+    return new_number(array->items[f64_index(array, argv[1])]);
+}
+
+/* (F64-SET! array index number) returns number. */
+sexpr *f64_set(int n, sexpr *argv[]) {
+    struct f64_array *array;
+
+    if (n != 3) {
+        raise_eval_error("f64-set! takes an array, an index and a number.");
+    }
+    array = f64_argument(argv[0]);
+    array->items[f64_index(array, argv[1])] = number_argument(argv[2]);
+    return argv[2];
+}
+
+sexpr *f64_length(int n, sexpr *argv[]) {
+    if (n != 1) {
+        raise_eval_error("f64-length takes exactly one array.");
+    }
+    return new_number(f64_argument(argv[0])->length);
+}
+
+sexpr *list_to_f64(int n, sexpr *argv[]) {
+    sexpr *cell, *rest;
+    size_t length = 0, i;
+
+    if (n != 1) {
+        raise_eval_error("list->f64 takes exactly one list.");
+    }
+
+    for (rest = argv[0]; (rest != NIL) && (rest->type == CONS); rest = rest->cdr) {
+        number_argument(rest->car);
+        length++;
+    }
+
+    cell = new_f64_array(length);
+    for (rest = argv[0], i = 0; i < length; rest = rest->cdr, i++) {
+        cell->f64->items[i] = rest->car->number;
+    }
+
+    return cell;
+}
+
+sexpr *f64_to_list(int n, sexpr *argv[]) {
+    sexpr *list = NIL;
+    size_t i;
+
+    if (n != 1) {
+        raise_eval_error("f64->list takes exactly one array.");
+    }
+
+    /* Back to front, so that the list comes out in order. The array is in
+     * argv, so it's safe from the collector. */
+    for (i = f64_argument(argv[0])->length; i > 0; i--) {
+        list = cons(new_number(argv[0]->f64->items[i - 1]), list);
+    }
+
+    return list;
+}
+
+static sexpr *elementwise(enum f64_operator op, int n, sexpr *argv[]) {
+    sexpr *cell;
+
+    if (n != 2) {
+        raise_eval_error("Elementwise operations take two arrays.");
+    }
+    if (f64_argument(argv[0])->length != f64_argument(argv[1])->length) {
+        raise_eval_error("Arrays differ in length.");
+    }
+
+    cell = new_f64_array(argv[0]->f64->length);
+    kernels()->elementwise(op, argv[0]->f64->items, argv[1]->f64->items,
+            cell->f64->items, cell->f64->length);
+
+    return cell;
+}
+
+sexpr *f64_add(int n, sexpr *argv[]) {
+    return elementwise(OP_ADD, n, argv);
+}
+
+sexpr *f64_sub(int n, sexpr *argv[]) {
+    return elementwise(OP_SUB, n, argv);
+}
+
+sexpr *f64_mul(int n, sexpr *argv[]) {
+    return elementwise(OP_MUL, n, argv);
+}
+
+sexpr *f64_div(int n, sexpr *argv[]) {
+    return elementwise(OP_DIV, n, argv);
+}
+
+/* (F64-SCALE array k) multiplies every element by k. */
+sexpr *f64_scale(int n, sexpr *argv[]) {
+    sexpr *cell;
+    l_number k;
+
+    if (n != 2) {
+        raise_eval_error("f64-scale takes an array and a number.");
+    }
+    f64_argument(argv[0]);
+    k = number_argument(argv[1]);
+
+    cell = new_f64_array(argv[0]->f64->length);
+    kernels()->scale(argv[0]->f64->items, k, cell->f64->items, cell->f64->length);
+
+    return cell;
+}
+
+sexpr *f64_dot(int n, sexpr *argv[]) {
+    if (n != 2) {
+        raise_eval_error("f64-dot takes two arrays.");
+    }
+    if (f64_argument(argv[0])->length != f64_argument(argv[1])->length) {
+        raise_eval_error("Arrays differ in length.");
+    }
+    return new_number(kernels()->dot(argv[0]->f64->items, argv[1]->f64->items,
+                argv[0]->f64->length));
+}
+
+sexpr *f64_sum(int n, sexpr *argv[]) {
+    if (n != 1) {
+        raise_eval_error("f64-sum takes exactly one array.");
+    }
+    f64_argument(argv[0]);
+    return new_number(kernels()->sum(argv[0]->f64->items, argv[0]->f64->length));
+}
+
+static sexpr *f64_extreme(bool largest, int n, sexpr *argv[]) {
+    if (n != 1) {
+        raise_eval_error("f64-min and f64-max take exactly one array.");
+    }
+    if (f64_argument(argv[0])->length == 0) {
+        raise_eval_error("The array is empty.");
+    }
+    return new_number(kernels()->extreme(largest, argv[0]->f64->items,
+                argv[0]->f64->length));
+}
+
+sexpr *f64_min(int n, sexpr *argv[]) {
+    return f64_extreme(false, n, argv);
+}
+
+sexpr *f64_max(int n, sexpr *argv[]) {
+    return f64_extreme(true, n, argv);
+}
+
+
+
+
+/*
+ * Strings.
+ *
+ * Strings of up to STRING_INLINE_LENGTH bytes are kept right in their
+ * cell. Longer ones live in the string arena, one record each: the index
+ * of the cell that owns it, the length, then the bytes (and a NUL). Cells
+ * refer to records by offset, so the arena is free to move when it grows
+ * -- and when the collector slides the live records down over the dead
+ * ones. Strings are immutable, so a record only ever has the one owner.
+ */
+
+struct string_record {
+    uint32_t owner;
+    uint32_t length;
+    char bytes[];
+};
+
+/* Records are kept 8-byte aligned. */
+#define RECORD_SIZE(length) \
+    ((sizeof(struct string_record) + (length) + 1 + 7) & ~(size_t) 7)
+
+static char *string_arena = NULL;
+static size_t arena_used = 0;
+static size_t arena_size = 0;
+
+#define is_arena_string(cell) \
+    (((cell)->type == STRING) && ((cell)->inline_length == STRING_IN_ARENA))
+
+static struct string_record *string_record(sexpr *string) {
+    return (struct string_record *) (string_arena + string->string_offset);
+}
+
+static char *string_bytes(sexpr *string) {
+    return is_arena_string(string) ? string_record(string)->bytes : string->inline_text;
+}
+
+static size_t string_length_of(sexpr *string) {
+    return is_arena_string(string) ? string->string_length : string->inline_length;
+}
+
+/* Takes size bytes off the end of the arena, growing it if need be. */
+static size_t arena_allocate(size_t size) {
+    size_t offset;
+
+    if (arena_used + size > arena_size) {
+        while (arena_used + size > arena_size) {
+            arena_size = (arena_size > 0) ? arena_size * 2 : 64 * 1024;
+        }
+        string_arena = realloc(string_arena, arena_size);
+        assert(string_arena != NULL);
+    }
+
+    offset = arena_used;
+    arena_used += size;
+    return offset;
+}
+
+/*
+ * Makes a string of the given length; its bytes are the caller's to fill
+ * in through string_bytes(). That pointer is only good until the next
+ * allocation, which may collect or grow the arena.
+ */
+static sexpr *new_string(size_t length) {
+    sexpr *string = new_cell();
+    struct string_record *record;
+    size_t offset;
+
+    if (length > UINT32_MAX) {
+        raise_eval_error("String too long.");
+    }
+
+    string->type = STRING;
+    if (length <= STRING_INLINE_LENGTH) {
+        string->inline_length = length;
+        return string;
+    }
+
+    /* Give the collector a chance to make room before growing. */
+    if (arena_used + RECORD_SIZE(length) > arena_size) {
+        string->inline_length = 0;
+        garbage_collect();
+    }
+
+    offset = arena_allocate(RECORD_SIZE(length));
+    record = (struct string_record *) (string_arena + offset);
+    record->owner = string - heap;
+    record->length = length;
+    record->bytes[length] = '\0';
+
+    string->inline_length = STRING_IN_ARENA;
+    string->string_offset = offset;
+    string->string_length = length;
+
+    return string;
+}
+
+/*
+ * Slides the records of every reached string down over the records of
+ * those that weren't. Must run after marking, but before sweeping.
+ */
+static void compact_strings(void) {
+    size_t offset = 0, live = 0, size;
+    struct string_record *record;
+    sexpr *owner;
+
+    while (offset < arena_used) {
+        record = (struct string_record *) (string_arena + offset);
+        owner = heap + record->owner;
+        size = RECORD_SIZE(record->length);
+
+        if ((owner->reached == FULLY_VISITED) && is_arena_string(owner)
+                && (owner->string_offset == offset)) {
+            if (live != offset) {
+                memmove(string_arena + live, record, size);
+                owner->string_offset = live;
+            }
+            live += size;
+        }
+        offset += size;
+    }
+
+    arena_used = live;
+}
+
+static int compare_strings(sexpr *a, sexpr *b) {
+    size_t a_length = string_length_of(a), b_length = string_length_of(b);
+    int order;
+
+    order = memcmp(string_bytes(a), string_bytes(b),
+            (a_length < b_length) ? a_length : b_length);
+    if (order != 0) {
+        return order;
+    }
+    return (a_length > b_length) - (a_length < b_length);
+}
+
+/* FNV-1a. */
+static uint64_t hash_string(sexpr *string) {
+    const unsigned char *bytes = (const unsigned char *) string_bytes(string);
+    size_t length = string_length_of(string), i;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Quoted and escaped, so that it reads back in as the same string. */
+static void display_string(sexpr *string) {
+    const char *bytes = string_bytes(string);
+    size_t length = string_length_of(string), i;
+
+    out_char('"');
+    for (i = 0; i < length; i++) {
+        switch (bytes[i]) {
+            case '"':  out_str("\\\""); break;
+            case '\\': out_str("\\\\"); break;
+            case '\n': out_str("\\n"); break;
+            case '\t': out_str("\\t"); break;
+            default:   out_char(bytes[i]);
+        }
+    }
+    out_char('"');
+}
+
+static sexpr *string_argument(sexpr *cell) {
+    if ((cell == NIL) || (cell->type != STRING)) {
+        fprintf(stderr, "Expected a string.\n");
+        longjmp(top_level_exception, EVAL_ERROR);
+    }
+    return cell;
+}
+
+sexpr *string_length(int n, sexpr *argv[]) {
+    if (n != 1) {
+        raise_eval_error("string-length takes exactly one string.");
+    }
+    return new_number(string_length_of(string_argument(argv[0])));
+}
+
+/* (STRING-APPEND string...) */
+sexpr *string_append(int n, sexpr *argv[]) {
+    size_t length = 0, at = 0;
+    sexpr *result;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        length += string_length_of(string_argument(argv[i]));
+    }
+
+    /* The arguments may move, but they're in argv, so they can't die. */
+    result = new_string(length);
+    for (i = 0; i < n; i++) {
+        memcpy(string_bytes(result) + at, string_bytes(argv[i]),
+                string_length_of(argv[i]));
+        at += string_length_of(argv[i]);
+    }
+
+    return result;
+}
+
+/* (SUBSTRING string start [end]): the bytes from start up to end. */
+sexpr *substring(int n, sexpr *argv[]) {
+    size_t length, start, end;
+    sexpr *result;
+
+    if ((n != 2) && (n != 3)) {
+        raise_eval_error("substring takes a string, a start and maybe an end.");
+    }
+
+    length = string_length_of(string_argument(argv[0]));
+    end = length;
+    if ((argv[1]->type != NUMBER) || (argv[1]->number < 0)
+            || (argv[1]->number > length)
+            || (argv[1]->number != (size_t) argv[1]->number)
+            || ((n == 3) && ((argv[2]->type != NUMBER)
+                    || (argv[2]->number < argv[1]->number)
+                    || (argv[2]->number > length)
+                    || (argv[2]->number != (size_t) argv[2]->number)))) {
+        raise_eval_error("substring: index out of range.");
+    }
+    start = argv[1]->number;
+    if (n == 3) {
+        end = argv[2]->number;
+    }
+
+    result = new_string(end - start);
+    memcpy(string_bytes(result), string_bytes(argv[0]) + start, end - start);
+
+    return result;
+}
+
+sexpr *string_eq(int n, sexpr *argv[]) {
+    if (n != 2) {
+        raise_eval_error("string=? takes two strings.");
+    }
+    return to_lisp_boolean(compare_strings(string_argument(argv[0]),
+                string_argument(argv[1])) == 0);
+}
+
+sexpr *string_lt(int n, sexpr *argv[]) {
+    if (n != 2) {
+        raise_eval_error("string<? takes two strings.");
+    }
+    return to_lisp_boolean(compare_strings(string_argument(argv[0]),
+                string_argument(argv[1])) < 0);
+}
+
+/* Names are taken as they are; nothing is made uppercase. */
+sexpr *string_to_symbol(int n, sexpr *argv[]) {
+    char name[NAME_LENGTH];
+    size_t length;
+    sexpr *symbol;
+
+    if (n != 1) {
+        raise_eval_error("string->symbol takes exactly one string.");
+    }
+
+    length = string_length_of(string_argument(argv[0]));
+    if ((length == 0) || (length >= NAME_LENGTH)
+            || (memchr(string_bytes(argv[0]), '\0', length) != NULL)) {
+        raise_eval_error("string->symbol: not a valid symbol name.");
+    }
+    memcpy(name, string_bytes(argv[0]), length);
+    name[length] = '\0';
+
+    symbol = new_cell();
+    symbol->type = SYMBOL;
+    symbol->symbol = insert_symbol(name);
+
+    return symbol;
+}
+
+sexpr *symbol_to_string(int n, sexpr *argv[]) {
+    const char *name;
+    sexpr *string;
+
+    if ((n != 1) || (argv[0] == NIL) || (argv[0]->type != SYMBOL)) {
+        raise_eval_error("symbol->string takes exactly one symbol.");
+    }
+
+    name = lookup(argv[0]->symbol);
+    string = new_string(strlen(name));
+    memcpy(string_bytes(string), name, strlen(name));
+
+    return string;
+}
+
+
+
+
+/*
+ * Tasks.
+ *
+ * (SPAWN function arg...) makes a task that applies function to the args,
+ * and returns a channel its value is sent to once it finishes. Tasks are
+ * cooperative: one only runs while the others YIELD or wait in RECEIVE,
+ * and SEND never waits.
+ *
+ * Each task evaluates on a C stack of its own, so eval() needs no changes:
+ * switching tasks is swapcontext(), plus swapping the error handler and
+ * call stack. Stacks are mapped with no swap reserved, so a task only
+ * costs the pages it touches; the price is a shallower recursion limit.
+ * The collector scans every task's stack, from wherever it was switched
+ * out.
+ */
+
+#define TASK_STACK_SIZE     (1024 * 1024)
+#define TASK_DEPTH_LIMIT    1000
+/* Finished tasks kept for reuse, stack and all. */
+#define SPARE_TASKS         64
+
+struct task {
+    ucontext_t context;
+    sigjmp_buf exception;
+    char *stack; /* TASK_STACK_SIZE bytes; NULL for the main task. */
+    void *sp; /* Where its stack was switched out. */
+    int call_depth;
+    int depth_limit;
+    l_symbol *calls; /* Its part of call_stack while switched out. */
+    int calls_size;
+    sexpr *function, *args; /* What it runs; until it starts. */
+    sexpr *channel; /* Gets its value. */
+    sexpr *waiting_on; /* The channel it's blocked in RECEIVE on. */
+    bool deadlocked; /* Woken because nothing else could run. */
+    struct task *next; /* In the run queue, or among a channel's waiting. */
+    struct task *prev_task, *next_task; /* In all_tasks. */
+};
+
+/* Whatever called into the interpreter. */
+static struct task main_task;
+static struct task *current_task = &main_task;
+/* Ready to run, first come first served. */
+static struct task *run_queue = NULL, *run_queue_end = NULL;
+/* Every unfinished task but main. */
+static struct task *all_tasks = NULL;
+static struct task *spare_tasks = NULL;
+static int spare_task_count = 0;
+/* Let go of by whichever task runs next: it was running on its stack. */
+static struct task *finished_task = NULL;
+
+/* Sent in place of a value by a task that raised an error; RECEIVE raises
+ * one in turn, so no program ever gets hold of it. */
+static sexpr task_failure = {
+    .type = END_OF_FILE,
+    .reached = 0,
+};
+
+static void run_task(void);
+
+static int mark_channel(struct channel *channel) {
+    int count = 0;
+    size_t i;
+
+    for (i = 0; i < channel->count; i++) {
+        count += mark_root(channel->items[(channel->head + i) % channel->capacity]);
+    }
+
+    return count;
+}
+
+static void *task_stack_bottom(struct task *task) {
+    return (task == &main_task) ? gc_stack_bottom : task->stack + TASK_STACK_SIZE;
+}
+
+/* The running stack from registers down, and every other from where it
+ * was switched out. The tasks themselves hold registers and values too. */
+static int mark_task_stacks(void *registers) {
+    struct task *task;
+    int count;
+
+    count = mark_region(registers, task_stack_bottom(current_task));
+    if (current_task != &main_task) {
+        count += mark_region(&main_task, &main_task + 1);
+        count += mark_region(main_task.sp, gc_stack_bottom);
+    }
+
+    for (task = all_tasks; task != NULL; task = task->next_task) {
+        count += mark_region(task, task + 1);
+        if ((task != current_task) && (task->sp != NULL)) {
+            count += mark_region(task->sp, task_stack_bottom(task));
+        }
+    }
+
+    return count;
+}
+
+static struct channel *allocate_channel(void) {
+    struct channel *channel = calloc(1, sizeof(*channel));
+    assert(channel != NULL);
+    return channel;
+}
+
+static sexpr *channel_argument(sexpr *cell) {
+    if ((cell == NIL) || (cell->type != CHANNEL)) {
+        fprintf(stderr, "Expected a channel.\n");
+        longjmp(top_level_exception, EVAL_ERROR);
+    }
+    return cell;
+}
+
+static void make_ready(struct task *task) {
+    task->next = NULL;
+    if (run_queue == NULL) {
+        run_queue = task;
+    } else {
+        run_queue_end->next = task;
+    }
+    run_queue_end = task;
+}
+
+static void stop_waiting(struct task *task) {
+    struct channel *channel = task->waiting_on->channel;
+    struct task *before = NULL, *waiter = channel->waiting;
+
+    while (waiter != task) {
+        before = waiter;
+        waiter = waiter->next;
+    }
+
+    if (before == NULL) {
+        channel->waiting = task->next;
+    } else {
+        before->next = task->next;
+    }
+    if (channel->last_waiting == task) {
+        channel->last_waiting = before;
+    }
+    task->waiting_on = NULL;
+}
+
+/* Appends value, waking whoever has waited longest for one. */
+static void send_value(sexpr *cell, sexpr *value) {
+    struct channel *channel = cell->channel;
+    struct task *waiter = channel->waiting;
+    size_t i, capacity;
+    sexpr **items;
+
+    if (channel->count == channel->capacity) {
+        capacity = (channel->capacity == 0) ? 8 : channel->capacity * 2;
+        items = malloc(capacity * sizeof(sexpr *));
+        assert(items != NULL);
+        for (i = 0; i < channel->count; i++) {
+            items[i] = channel->items[(channel->head + i) % channel->capacity];
+        }
+        free(channel->items);
+        channel->items = items;
+        channel->capacity = capacity;
+        channel->head = 0;
+    }
+    channel->items[(channel->head + channel->count++) % channel->capacity] = value;
+
+    if (waiter != NULL) {
+        stop_waiting(waiter);
+        make_ready(waiter);
+    }
+}
+
+static struct task *new_task(void) {
+    struct task *task = spare_tasks;
+
+    if (task != NULL) {
+        spare_tasks = task->next;
+        spare_task_count--;
+    } else {
+        task = calloc(1, sizeof(*task));
+        assert(task != NULL);
+        task->stack = mmap(NULL, TASK_STACK_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (task->stack == MAP_FAILED) {
+            free(task);
+            fprintf(stderr, "Out of memory for task stacks.\n");
+            longjmp(top_level_exception, EVAL_ERROR);
+        }
+        /* Overflowing it faults rather than scribbling on a neighbour. */
+        mprotect(task->stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+    }
+
+    getcontext(&task->context);
+    task->context.uc_stack.ss_sp = task->stack;
+    task->context.uc_stack.ss_size = TASK_STACK_SIZE;
+    task->context.uc_link = NULL;
+    makecontext(&task->context, run_task, 0);
+    task->sp = NULL;
+    task->waiting_on = NULL;
+    task->deadlocked = false;
+
+    task->prev_task = NULL;
+    task->next_task = all_tasks;
+    if (all_tasks != NULL) {
+        all_tasks->prev_task = task;
+    }
+    all_tasks = task;
+
+    return task;
+}
+
+static void release_finished_task(void) {
+    struct task *task = finished_task;
+
+    if (task == NULL) {
+        return;
+    }
+    finished_task = NULL;
+
+    if (spare_task_count < SPARE_TASKS) {
+        task->next = spare_tasks;
+        spare_tasks = task;
+        spare_task_count++;
+    } else {
+        munmap(task->stack, TASK_STACK_SIZE);
+        free(task->calls);
+        free(task);
+    }
+}
+
+static void switch_out(struct task *task) {
+    int i, depth = (call_depth < MAX_CALL_DEPTH) ? call_depth : MAX_CALL_DEPTH;
+
+    if (depth > task->calls_size) {
+        task->calls_size = depth * 2;
+        task->calls = realloc(task->calls, task->calls_size * sizeof(l_symbol));
+        assert(task->calls != NULL);
+    }
+    for (i = 0; i < depth; i++) {
+        task->calls[i] = call_stack[i];
+    }
+
+    task->call_depth = call_depth;
+    task->depth_limit = depth_limit;
+    memcpy(task->exception, top_level_exception, sizeof(sigjmp_buf));
+}
+
+static void switch_in(struct task *task) {
+    int i, depth = (task->call_depth < MAX_CALL_DEPTH) ? task->call_depth : MAX_CALL_DEPTH;
+
+    for (i = 0; i < depth; i++) {
+        call_stack[i] = task->calls[i];
+    }
+
+    call_depth = task->call_depth;
+    depth_limit = task->depth_limit;
+    memcpy(top_level_exception, task->exception, sizeof(sigjmp_buf));
+    release_finished_task();
+}
+
+/* Returns once something switches back. As in mark_stack(), setjmp()
+ * spills the registers for the collector -- here, below everything on the
+ * stack it's to scan. */
+static void __attribute__((noinline)) switch_task(struct task *next) {
+    struct task *self = current_task;
+    jmp_buf registers;
+
+    if (next == self) {
+        return;
+    }
+
+    switch_out(self);
+    setjmp(registers);
+    self->sp = &registers;
+    current_task = next;
+    swapcontext(&self->context, &next->context);
+    switch_in(self);
+}
+
+/* Who runs when the current task can't. If nobody is ready, main must be
+ * waiting -- for something that can never come. */
+static struct task *next_task(void) {
+    struct task *next = run_queue;
+
+    if (next != NULL) {
+        run_queue = next->next;
+        return next;
+    }
+
+    assert(current_task != &main_task);
+    stop_waiting(&main_task);
+    main_task.deadlocked = true;
+    return &main_task;
+}
+
+static void run_task(void) {
+    struct task *self = current_task;
+    sexpr *volatile value = &task_failure;
+
+    release_finished_task();
+    call_depth = 0;
+    depth_limit = (main_task.depth_limit < TASK_DEPTH_LIMIT)
+        ? main_task.depth_limit : TASK_DEPTH_LIMIT;
+
+    if (setjmp(top_level_exception) == NOT_EVALUATED) {
+        value = apply(self->function, self->args);
+    } else {
+        fprintf(stderr, "Evaluation error in task.\n");
+    }
+
+    send_value(self->channel, value);
+    self->function = self->args = self->channel = NIL;
+
+    if (self->prev_task != NULL) {
+        self->prev_task->next_task = self->next_task;
+    } else {
+        all_tasks = self->next_task;
+    }
+    if (self->next_task != NULL) {
+        self->next_task->prev_task = self->prev_task;
+    }
+
+    finished_task = self;
+    switch_task(next_task());
+    assert(!"finished task resumed");
+}
+
+sexpr *make_channel(int n, sexpr *argv[]) {
+    sexpr *cell;
+
+    if (n != 0) {
+        raise_eval_error("make-channel takes no arguments.");
+    }
+
+    cell = new_cell();
+
+    cell->type = CHANNEL;
+    cell->channel = allocate_channel();
+
+    return cell;
+}
+
+/* (SPAWN function arg...) */
+sexpr *spawn_task(int n, sexpr *argv[]) {
+    sexpr *args = NIL, *channel;
+    struct task *task;
+    int i;
+
+    if ((n < 1) || (argv[0] == NIL) || ((argv[0]->type != FUNCTION)
+                && (argv[0]->type != BUILT_IN_FUNCTION))) {
+        raise_eval_error("spawn takes a function and its arguments.");
+    }
+
+    for (i = n - 1; i > 0; i--) {
+        args = cons(argv[i], args);
+    }
+    channel = make_channel(0, NULL);
+
+    task = new_task();
+    task->function = argv[0];
+    task->args = args;
+    task->channel = channel;
+    make_ready(task);
+
+    return channel;
+}
+
+/* Lets every task that's ready run first. */
+sexpr *yield_task(int n, sexpr *argv[]) {
+    if (n != 0) {
+        raise_eval_error("yield takes no arguments.");
+    }
+    if (run_queue != NULL) {
+        make_ready(current_task);
+        switch_task(next_task());
+    }
+    return NIL;
+}
+
+/* (SEND channel value) returns value. */
+sexpr *channel_send(int n, sexpr *argv[]) {
+    if (n != 2) {
+        raise_eval_error("send takes a channel and a value.");
+    }
+    send_value(channel_argument(argv[0]), argv[1]);
+    return argv[1];
+}
+
+/* Waits, if need be, for the next value sent to the channel. */
+sexpr *channel_receive(int n, sexpr *argv[]) {
+    struct task *self = current_task;
+    struct channel *channel;
+    sexpr *value;
+
+    if (n != 1) {
+        raise_eval_error("receive takes exactly one channel.");
+    }
+    channel = channel_argument(argv[0])->channel;
+
+    while (channel->count == 0) {
+        if ((self == &main_task) && (run_queue == NULL)) {
+            raise_eval_error("Deadlock: nothing can send to the channel.");
+        }
+
+        self->next = NULL;
+        if (channel->waiting == NULL) {
+            channel->waiting = self;
+        } else {
+            channel->last_waiting->next = self;
+        }
+        channel->last_waiting = self;
+        self->waiting_on = argv[0];
+
+        switch_task(next_task());
+        if (self->deadlocked) {
+            self->deadlocked = false;
+            raise_eval_error("Deadlock: nothing can send to the channel.");
+        }
+    }
+
+    value = channel->items[channel->head];
+    channel->head = (channel->head + 1) % channel->capacity;
+    channel->count--;
+
+    if (value == &task_failure) {
+        raise_eval_error("The task sending to the channel failed.");
+    }
+    return value;
+}
+
+
+
+
+/*
+ * Binary serialization (FASL).
+ *
+ * (SAVE port expr) writes expr in a form LOAD-BINARY can read back far
+ * faster than l_read() can parse text. All integers are unsigned and
+ * little-endian:
+ *
+ *   magic          4 bytes     "LFSL"
+ *   version        u8          FASL_VERSION
+ *   symbol count   u32
+ *   symbols        one per symbol: u8 length, then that many name bytes
+ *   node count     u32
+ *   nodes          one per distinct cell, numbered from 1, as a tag byte
+ *                  followed by its payload:
+ *                      'N'  number; 8 byte IEEE-754 double
+ *                      'S'  symbol; u32 index into the symbol table
+ *                      'C'  cons;   u32 car node, u32 cdr node
+ *                      'E'  the #EOF object; no payload
+ *   root           u32 node
+ *
+ * Node 0 is NIL. A cell reachable more than once is written once and
+ * referred to by number everywhere else, so shared (and even circular)
+ * structure survives the round trip. Functions and ports can't be saved.
+ */
+
+#define FASL_MAGIC      "LFSL"
+#define FASL_VERSION    1
+
+#define FASL_NUMBER     'N'
+#define FASL_SYMBOL     'S'
+#define FASL_CONS       'C'
+#define FASL_EOF        'E'
+
+/* State of the LOAD-BINARY in progress, released when it fails. */
+static sexpr *fasl_port = NIL;
+static l_symbol *fasl_symbols;
+static unsigned char *fasl_records;
+static sexpr **fasl_cells;
+
+static void free_fasl_buffers(void) {
+    free(fasl_symbols);
+    free(fasl_records);
+    free(fasl_cells);
+    fasl_port = NIL;
+    fasl_symbols = NULL;
+    fasl_records = NULL;
+    fasl_cells = NULL;
+}
+
+/* The port is closed too: where a malformed file leaves it is anyone's
+ * guess. */
+static void fasl_error(void) {
+    if ((fasl_port != NIL) && (fasl_port->stream != NULL)) {
+        if (fasl_port->stream != stdin) {
+            fclose(fasl_port->stream);
+        }
+        fasl_port->stream = NULL;
+    }
+    free_fasl_buffers();
+    fprintf(stderr, "Malformed binary file.\n");
+    longjmp(top_level_exception, EVAL_ERROR);
+}
+
+static void write_u32(FILE *out, uint32_t value) {
+    unsigned char bytes[4] = {
+        value, value >> 8, value >> 16, value >> 24
+    };
+    fwrite(bytes, 1, sizeof(bytes), out);
+}
+
+static uint32_t decode_u32(const unsigned char *bytes) {
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16)
+        | ((uint32_t) bytes[3] << 24);
+}
+
+static uint32_t read_u32(FILE *in) {
+    unsigned char bytes[4];
+    if (fread(bytes, 1, sizeof(bytes), in) != sizeof(bytes)) {
+        fasl_error();
+    }
+    return decode_u32(bytes);
+}
+
+static void write_number(FILE *out, l_number number) {
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    write_u32(out, bits);
+    write_u32(out, bits >> 32);
+}
+
+static l_number decode_number(const unsigned char *bytes) {
+    uint64_t bits = decode_u32(bytes) | ((uint64_t) decode_u32(bytes + 4) << 32);
+    l_number number;
+    memcpy(&number, &bits, sizeof(number));
+    return number;
+}
+
+/* Cells numbered so far, and the number of each heap cell (0 if unseen). */
+struct fasl_nodes {
+    sexpr **cells;
+    uint32_t *heap_nodes;
+    uint32_t eof_node;
+    uint32_t count;
+};
+
+static uint32_t *fasl_node_of(struct fasl_nodes *nodes, sexpr *cell) {
+    if (cell == EOF_OBJECT) {
+        return &nodes->eof_node;
+    }
+    assert((cell >= heap) && (cell < heap + HEAP_SIZE));
+    return &nodes->heap_nodes[cell - heap];
+}
+
+/* Numbers the cell, if it hasn't been already. Returns its number. */
+static uint32_t fasl_visit(struct fasl_nodes *nodes, sexpr *cell) {
+    uint32_t *node;
+
+    if (cell == NIL) {
+        return 0;
+    }
+
+    node = fasl_node_of(nodes, cell);
+    if (*node == 0) {
+        *node = ++nodes->count;
+        nodes->cells[nodes->count] = cell;
+    }
+
+    return *node;
+}
+
+sexpr *save(int n, sexpr *argv[]) {
+    FILE *out;
+    sexpr *cell;
+    struct fasl_nodes nodes = { .eof_node = 0, .count = 0 };
+    uint32_t i;
+    int symbol_index[MAX_NAMES];
+    l_symbol symbols[MAX_NAMES];
+    uint32_t symbol_count = 0;
+
+    if (n != 2) {
+        raise_eval_error("save takes a port and an expression.");
+    }
+    out = port_stream(argv[0]);
+
+    /* Number every distinct cell in the order they're found. The node table
+     * doubles as the work queue. */
+    nodes.heap_nodes = calloc(HEAP_SIZE, sizeof(uint32_t));
+    nodes.cells = malloc((HEAP_SIZE + 2) * sizeof(sexpr *));
+    assert((nodes.heap_nodes != NULL) && (nodes.cells != NULL));
+    memset(symbol_index, -1, sizeof(symbol_index));
+
+    fasl_visit(&nodes, argv[1]);
+    for (i = 1; i <= nodes.count; i++) {
+        cell = nodes.cells[i];
+
+        switch (cell->type) {
+            case CONS:
+                fasl_visit(&nodes, cell->car);
+                fasl_visit(&nodes, cell->cdr);
+                break;
+            case SYMBOL:
+                if (symbol_index[cell->symbol] < 0) {
+                    symbol_index[cell->symbol] = symbol_count;
+                    symbols[symbol_count++] = cell->symbol;
+                }
+                break;
+            case NUMBER:
+            case END_OF_FILE:
+                break;
+            default:
+                free(nodes.heap_nodes);
+                free(nodes.cells);
+                raise_eval_error("save: can only save lists, numbers and symbols.");
+        }
+    }
+
+    fwrite(FASL_MAGIC, 1, 4, out);
+    putc(FASL_VERSION, out);
+
+    write_u32(out, symbol_count);
+    for (i = 0; i < symbol_count; i++) {
+        char *name = lookup(symbols[i]);
+        putc(strlen(name), out);
+        fwrite(name, 1, strlen(name), out);
+    }
+
+    write_u32(out, nodes.count);
+    for (i = 1; i <= nodes.count; i++) {
+        cell = nodes.cells[i];
+
+        switch (cell->type) {
+            case NUMBER:
+                putc(FASL_NUMBER, out);
+                write_number(out, cell->number);
+                break;
+            case SYMBOL:
+                putc(FASL_SYMBOL, out);
+                write_u32(out, symbol_index[cell->symbol]);
+                break;
+            case CONS:
+                putc(FASL_CONS, out);
+                write_u32(out, fasl_visit(&nodes, cell->car));
+                write_u32(out, fasl_visit(&nodes, cell->cdr));
+                break;
+            default:
+                putc(FASL_EOF, out);
+        }
+    }
+
+    write_u32(out, (argv[1] == NIL) ? 0 : 1);
+    fflush(out);
+
+    free(nodes.heap_nodes);
+    free(nodes.cells);
+
+    return argv[1];
+}
+
+/* Largest payload of any node. */
+#define FASL_NODE_SIZE  9
+
+/*
+ * (LOAD-BINARY port) reads back one expression written by SAVE. The nodes
+ * are read in one go, then every cell they need is taken off the free
+ * list at once and filled in place.
+ */
+sexpr *load_binary(int n, sexpr *argv[]) {
+    FILE *in;
+    char magic[4], name[NAME_LENGTH];
+    sexpr *root;
+    uint32_t symbol_count, node_count, root_node, i;
+    int length;
+
+    if (n != 1) {
+        raise_eval_error("load-binary takes exactly one port.");
+    }
+    in = port_stream(argv[0]);
+
+    /* Anything left over from a load cut short by some other error. */
+    free_fasl_buffers();
+    fasl_port = argv[0];
+
+    if ((fread(magic, 1, 4, in) != 4) || (memcmp(magic, FASL_MAGIC, 4) != 0)
+            || (getc(in) != FASL_VERSION)) {
+        fasl_error();
+    }
+
+    /* Interning may allocate, so it all has to happen up front. */
+    symbol_count = read_u32(in);
+    if (symbol_count > MAX_NAMES) {
+        fasl_error();
+    }
+    fasl_symbols = malloc((symbol_count + 1) * sizeof(l_symbol));
+    if (fasl_symbols == NULL) {
+        raise_eval_error("load-binary: out of memory.");
+    }
+    for (i = 0; i < symbol_count; i++) {
+        length = getc(in);
+        if ((length <= 0) || (length >= NAME_LENGTH)
+                || (fread(name, 1, length, in) != (size_t) length)) {
+            fasl_error();
+        }
+        name[length] = '\0';
+        fasl_symbols[i] = insert_symbol(name);
+    }
+
+    node_count = read_u32(in);
+    if (node_count > HEAP_SIZE) {
+        free_fasl_buffers();
+        raise_eval_error("load-binary: not enough cells.");
+    }
+
+    fasl_records = malloc((node_count + 1) * (1 + FASL_NODE_SIZE));
+    fasl_cells = malloc((node_count + 1) * sizeof(sexpr *));
+    if ((fasl_records == NULL) || (fasl_cells == NULL)) {
+        free_fasl_buffers();
+        raise_eval_error("load-binary: out of memory.");
+    }
+
+    /* Node records are variable length; spread them into fixed slots. */
+    for (i = 1; i <= node_count; i++) {
+        unsigned char *record = fasl_records + i * (1 + FASL_NODE_SIZE);
+        size_t size;
+
+        record[0] = getc(in);
+        switch (record[0]) {
+            case FASL_NUMBER: size = 8; break;
+            case FASL_SYMBOL: size = 4; break;
+            case FASL_CONS: size = 8; break;
+            case FASL_EOF: size = 0; break;
+            default: size = FASL_NODE_SIZE + 1;
+        }
+
+        if ((size > FASL_NODE_SIZE)
+                || (fread(record + 1, 1, size, in) != size)
+                || ((record[0] == FASL_SYMBOL)
+                    && (decode_u32(record + 1) >= symbol_count))
+                || ((record[0] == FASL_CONS)
+                    && ((decode_u32(record + 1) > node_count)
+                        || (decode_u32(record + 5) > node_count)))) {
+            fasl_error();
+        }
+    }
+    root_node = read_u32(in);
+    if (root_node > node_count) {
+        fasl_error();
+    }
+
+    if (!reserve_cells(node_count)) {
+        free_fasl_buffers();
+        raise_eval_error("load-binary: not enough cells.");
+    }
+
+    /* From here on, nothing may allocate except through the reservation. */
+    fasl_cells[0] = NIL;
+    for (i = 1; i <= node_count; i++) {
+        fasl_cells[i] = (fasl_records[i * (1 + FASL_NODE_SIZE)] == FASL_EOF)
+            ? EOF_OBJECT : new_cell();
+    }
+
+    for (i = 1; i <= node_count; i++) {
+        unsigned char *record = fasl_records + i * (1 + FASL_NODE_SIZE);
+        sexpr *cell = fasl_cells[i];
+
+        switch (record[0]) {
+            case FASL_NUMBER:
+                cell->type = NUMBER;
+                cell->number = decode_number(record + 1);
+                break;
+            case FASL_SYMBOL:
+                cell->type = SYMBOL;
+                cell->symbol = fasl_symbols[decode_u32(record + 1)];
+                break;
+            case FASL_CONS:
+                cell->type = CONS;
+                cell->car = fasl_cells[decode_u32(record + 1)];
+                cell->cdr = fasl_cells[decode_u32(record + 5)];
+                break;
+        }
+    }
+
+    root = fasl_cells[root_node];
+    free_fasl_buffers();
+    return root;
+}
+
+
+static struct builtin_func_def BUILT_INS[] = {
+#define SYMBOL(id, name)
+#define BUILTIN(id, name, function, arity) { id, function, arity },
+#define MACRO(id, name, function, arity) { id, function, arity, true },
+#include "symbols.def"
+};
+
+
+static void insert_initial_environment(void) {
+    int i;
+    sexpr *func;
+
+    int builtin_count = sizeof(BUILT_INS)/sizeof(struct builtin_func_def);
+
+    for (i = 0; i < builtin_count; i++) {
+        func = new_cell();
+        func->type = BUILT_IN_FUNCTION;
+        func->arity = BUILT_INS[i].arity;
+        func->func = BUILT_INS[i].func;
+        func->builtin_symbol = BUILT_INS[i].identifier;
+        func->macro = BUILT_INS[i].macro;
+
+        update_environment(&global, slookup(BUILT_INS[i].identifier), func);
+    }
+
+    /* And also, T, which evaluates to itself. */
+    update_environment(&global, slookup(T), slookup(T));
+
+}
+
+
+
+/*
+ * Heap images.
+ *
+ * The entire interpreter state -- the heap, the symbol table and the global
+ * environment -- can be dumped to a file and mapped back in at startup in
+ * place of init() and whatever prelude would normally follow it.
+ *
+ * Pointers are stored as position-independent cell numbers: 0 is NIL,
+ * n is heap[n - 1], and IMAGE_EOF is the #EOF object. Built-in functions
+ * are stored as their index in BUILT_INS, since the executable may be
+ * loaded anywhere. An image only makes sense to the build that dumped it.
+ */
+
+#define IMAGE_MAGIC     "LIMG"
+#define IMAGE_VERSION   4
+#define IMAGE_EOF       (HEAP_SIZE + 1)
+
+/* Ports can't outlive the process; all but stdin come back closed. Nor
+ * can tasks: channels come back empty. */
+#define IMAGE_PORT_CLOSED   0
+#define IMAGE_PORT_STDIN    1
+
+struct image_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t heap_size;
+    uint32_t cell_size;
+    uint32_t builtin_count;
+
+    uint32_t next_symbol_id;
+    uint32_t free_cell_count;
+    uint64_t next_free_cell;
+    uint64_t global;
+    uint64_t name_list;
+
+    /* Bytes after the cells: whatever cells keep outside of the heap. */
+    uint64_t extra_size;
+};
+
+/* In a dumped hash table, keys that aren't cells. */
+#define IMAGE_EMPTY_KEY     (HEAP_SIZE + 2)
+#define IMAGE_DELETED_KEY   (HEAP_SIZE + 3)
+
+struct image_extra {
+    char *bytes;
+    size_t size;
+    size_t capacity;
+};
+
+/* Copies size bytes to the end of extra; returns where they went. */
+static void *append_extra(struct image_extra *extra, const void *data, size_t size) {
+    while (extra->size + size > extra->capacity) {
+        extra->capacity = (extra->capacity > 0) ? extra->capacity * 2 : 4096;
+        extra->bytes = realloc(extra->bytes, extra->capacity);
+        assert(extra->bytes != NULL);
+    }
+    memcpy(extra->bytes + extra->size, data, size);
+    extra->size += size;
+    return extra->bytes + extra->size - size;
+}
+
+static uint64_t image_offset(sexpr *cell) {
+    if (cell == NIL) {
+        return 0;
+    } else if (cell == EOF_OBJECT) {
+        return IMAGE_EOF;
+    }
+
+    assert((cell >= heap) && (cell < heap + HEAP_SIZE));
+    return (cell - heap) + 1;
+}
+
+static sexpr *image_pointer(uint64_t offset) {
+    if (offset == 0) {
+        return NIL;
+    } else if (offset == IMAGE_EOF) {
+        return EOF_OBJECT;
+    }
+    return heap + (offset - 1);
+}
+
+#define BUILTIN_COUNT   (sizeof(BUILT_INS) / sizeof(struct builtin_func_def))
+
+bool dump_image(const char *path) {
+    struct image_header header = {
+        .magic = IMAGE_MAGIC,
+        .version = IMAGE_VERSION,
+        .heap_size = HEAP_SIZE,
+        .cell_size = sizeof(sexpr),
+        .builtin_count = BUILTIN_COUNT,
+    };
+    sexpr *cells, *cell;
+    bool *is_free, ok;
+    FILE *out;
+    size_t i, j, offset;
+    struct image_extra extra = { NULL, 0, 0 };
+    struct hash_table *table;
+    struct hash_slot *slot;
+    struct vector *vector;
+
+    /* Don't bother saving garbage. */
+    garbage_collect();
+
+    header.next_symbol_id = next_symbol_id;
+    header.free_cell_count = free_cell_count;
+    header.next_free_cell = image_offset(next_free_cell);
+    header.global = image_offset(global);
+    header.name_list = image_offset(name_list);
+
+    cells = malloc(HEAP_SIZE * sizeof(sexpr));
+    is_free = calloc(HEAP_SIZE, sizeof(bool));
+    assert((cells != NULL) && (is_free != NULL));
+
+    for (cell = next_free_cell; cell != NIL; cell = cell->cdr) {
+        is_free[cell - heap] = true;
+    }
+
+    memcpy(cells, heap, HEAP_SIZE * sizeof(sexpr));
+    for (i = 0; i < HEAP_SIZE; i++) {
+        cell = cells + i;
+
+        if (is_free[i]) {
+            /* Whatever it was, a free cell only has a cdr now. */
+            cell->type = CONS;
+            cell->car = (sexpr *) (uintptr_t) image_offset(NIL);
+            cell->cdr = (sexpr *) (uintptr_t) image_offset(heap[i].cdr);
+            continue;
+        }
+
+        switch (cell->type) {
+            case CONS:
+            case FUNCTION:
+                cell->car = (sexpr *) (uintptr_t) image_offset(heap[i].car);
+                cell->cdr = (sexpr *) (uintptr_t) image_offset(heap[i].cdr);
+                break;
+
+            case BUILT_IN_FUNCTION:
+                for (j = 0; j < BUILTIN_COUNT; j++) {
+                    if (BUILT_INS[j].func == heap[i].func) {
+                        break;
+                    }
+                }
+                assert(j < BUILTIN_COUNT);
+                cell->func = (l_builtin) (uintptr_t) j;
+                break;
+
+            case PORT:
+                cell->stream = (FILE *) (uintptr_t) ((heap[i].stream == stdin)
+                        ? IMAGE_PORT_STDIN : IMAGE_PORT_CLOSED);
+                break;
+
+            case CHANNEL:
+                cell->channel = NULL;
+                break;
+
+            case HASH_TABLE:
+                /* The table goes in the extra bytes, keys and values as
+                 * offsets, hashes untouched. */
+                offset = extra.size;
+                table = append_extra(&extra, heap[i].table, sizeof(struct hash_table)
+                        + heap[i].table->capacity * sizeof(struct hash_slot));
+                for (j = 0; j < table->capacity; j++) {
+                    slot = &table->slots[j];
+                    if (slot->key == NULL) {
+                        slot->key = (sexpr *) (uintptr_t) IMAGE_EMPTY_KEY;
+                    } else if (slot->key == DELETED_KEY) {
+                        slot->key = (sexpr *) (uintptr_t) IMAGE_DELETED_KEY;
+                    } else {
+                        slot->key = (sexpr *) (uintptr_t) image_offset(slot->key);
+                        slot->value = (sexpr *) (uintptr_t) image_offset(slot->value);
+                    }
+                }
+                cell->table = (struct hash_table *) (uintptr_t) offset;
+                break;
+
+            case VECTOR:
+                offset = extra.size;
+                vector = append_extra(&extra, heap[i].vector, sizeof(struct vector)
+                        + heap[i].vector->length * sizeof(sexpr *));
+                for (j = 0; j < vector->length; j++) {
+                    vector->items[j] = (sexpr *) (uintptr_t) image_offset(vector->items[j]);
+                }
+                cell->vector = (struct vector *) (uintptr_t) offset;
+                break;
+
+            case F64_ARRAY:
+                offset = extra.size;
+                append_extra(&extra, heap[i].f64, sizeof(struct f64_array)
+                        + heap[i].f64->length * sizeof(l_number));
+                cell->f64 = (struct f64_array *) (uintptr_t) offset;
+                break;
+
+            case STRING:
+                if (is_arena_string(cell)) {
+                    cell->string_offset = extra.size;
+                    append_extra(&extra, string_record(heap + i),
+                            RECORD_SIZE(cell->string_length));
+                }
+                break;
+
+            default:
+                /* Everything else is plain data. */
+                break;
+        }
+    }
+
+    header.extra_size = extra.size;
+
+    out = fopen(path, "wb");
+    ok = (out != NULL)
+        && (fwrite(&header, sizeof(header), 1, out) == 1)
+        && (fwrite(cells, sizeof(sexpr), HEAP_SIZE, out) == HEAP_SIZE)
+        && (fwrite(extra.bytes, 1, extra.size, out) == extra.size);
+    if (out != NULL) {
+        ok = (fclose(out) == 0) && ok;
+    }
+
+    free(cells);
+    free(is_free);
+    free(extra.bytes);
+
+    return ok;
+}
+
+bool load_image(const char *path) {
+    const struct image_header *header;
+    const sexpr *cells;
+    const char *extra;
+    const struct hash_table *dumped;
+    const struct hash_slot *from;
+    struct hash_slot *slot;
+    const struct vector *vector;
+    const struct f64_array *array;
+    size_t size;
+    struct stat info;
+    void *image;
+    sexpr *cell, *pair;
+    size_t i, j;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    if ((fstat(fd, &info) != 0)
+            || ((size_t) info.st_size < sizeof(*header) + HEAP_SIZE * sizeof(sexpr))) {
+        close(fd);
+        return false;
+    }
+
+    image = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return false;
+    }
+
+    header = image;
+    cells = (const sexpr *) (header + 1);
+    extra = (const char *) (cells + HEAP_SIZE);
+
+    if ((memcmp(header->magic, IMAGE_MAGIC, 4) != 0)
+            || (header->version != IMAGE_VERSION)
+            || (header->heap_size != HEAP_SIZE)
+            || (header->cell_size != sizeof(sexpr))
+            || (header->builtin_count != BUILTIN_COUNT)
+            || ((size_t) info.st_size != sizeof(*header) + HEAP_SIZE * sizeof(sexpr)
+                + header->extra_size)) {
+        munmap(image, info.st_size);
+        return false;
+    }
+
+    /* Relocate every cell into the heap. */
+    memcpy(heap, cells, HEAP_SIZE * sizeof(sexpr));
+    for (i = 0; i < HEAP_SIZE; i++) {
+        cell = heap + i;
+
+        switch (cell->type) {
+            case CONS:
+            case FUNCTION:
+                cell->car = image_pointer((uintptr_t) cells[i].car);
+                cell->cdr = image_pointer((uintptr_t) cells[i].cdr);
+                break;
+
+            case BUILT_IN_FUNCTION:
+                cell->func = BUILT_INS[(uintptr_t) cells[i].func].func;
+                break;
+
+            case PORT:
+                cell->stream = ((uintptr_t) cells[i].stream == IMAGE_PORT_STDIN)
+                    ? stdin : NULL;
+                break;
+
+            case CHANNEL:
+                cell->channel = allocate_channel();
+                break;
+
+            case HASH_TABLE:
+                dumped = (const struct hash_table *) (extra + (uintptr_t) cells[i].table);
+                cell->table = allocate_table(dumped->capacity);
+                cell->table->count = dumped->count;
+                cell->table->used = dumped->used;
+                for (j = 0; j < dumped->capacity; j++) {
+                    from = &dumped->slots[j];
+                    slot = &cell->table->slots[j];
+                    slot->hash = from->hash;
+                    if ((uintptr_t) from->key == IMAGE_EMPTY_KEY) {
+                        slot->key = NULL;
+                    } else if ((uintptr_t) from->key == IMAGE_DELETED_KEY) {
+                        slot->key = DELETED_KEY;
+                    } else {
+                        slot->key = image_pointer((uintptr_t) from->key);
+                        slot->value = image_pointer((uintptr_t) from->value);
+                    }
+                }
+                break;
+
+            case VECTOR:
+                vector = (const struct vector *) (extra + (uintptr_t) cells[i].vector);
+                cell->vector = allocate_vector(vector->length);
+                for (j = 0; j < vector->length; j++) {
+                    cell->vector->items[j] = image_pointer((uintptr_t) vector->items[j]);
+                }
+                break;
+
+            case F64_ARRAY:
+                array = (const struct f64_array *) (extra + (uintptr_t) cells[i].f64);
+                size = sizeof(struct f64_array) + array->length * sizeof(l_number);
+                cell->f64 = malloc(size);
+                assert(cell->f64 != NULL);
+                memcpy(cell->f64, array, size);
+                break;
+
+            case STRING:
+                if (is_arena_string(cell)) {
+                    size = RECORD_SIZE(cell->string_length);
+                    cell->string_offset = arena_allocate(size);
+                    memcpy(string_record(cell), extra + cells[i].string_offset, size);
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    next_symbol_id = header->next_symbol_id;
+    free_cell_count = header->free_cell_count;
+    next_free_cell = image_pointer(header->next_free_cell);
+    global = image_pointer(header->global);
+    name_list = image_pointer(header->name_list);
+
+    munmap(image, info.st_size);
+
+    /* Names don't move, but the heap they're in did. */
+    for (cell = name_list; cell != NIL; cell = cell->cdr) {
+        pair = cell->car;
+        symbol_names[pair->car->symbol] = pair->cdr->word;
+        symbol_cells[pair->car->symbol] = pair->car;
+    }
+
+    /* The image doesn't carry closure names; recover them from what's
+     * globally bound. */
+    for (cell = global; cell != NIL; cell = cell->cdr) {
+        pair = cell->car;
+        if ((pair->cdr != NIL) && (pair->cdr->type == FUNCTION)) {
+            closure_names[pair->cdr - heap] = pair->car->symbol + 1;
+        }
+    }
+
+    atexit(flush_output);
+
+    return true;
+}
+
+
+
+
+/*
+ * Sampling profiler.
+ *
+ * Every millisecond of CPU time, SIGPROF copies the call stack into a
+ * buffer that was set aside in advance; the handler does nothing else.
+ * At exit, identical stacks are counted and written out collapsed, one
+ * per line ("OUTER;INNER count"), as flame graph tools expect.
+ */
+
+#define PROFILE_INTERVAL_USEC   1000
+#define PROFILE_BUFFER_WORDS    (1 << 22)
+
+/* Samples, one after the other: the depth, then that many names. */
+static l_symbol *profile_buffer = NULL;
+static volatile size_t profile_used = 0;
+static volatile unsigned long profile_dropped = 0;
+static FILE *profile_out = NULL;
+
+static void take_sample(int signal) {
+    size_t depth = call_depth, i;
+    (void) signal;
+
+    if (depth > MAX_CALL_DEPTH) {
+        depth = MAX_CALL_DEPTH;
+    }
+    if (profile_used + depth + 1 > PROFILE_BUFFER_WORDS) {
+        profile_dropped++;
+        return;
+    }
+
+    profile_buffer[profile_used] = depth;
+    for (i = 0; i < depth; i++) {
+        profile_buffer[profile_used + 1 + i] = call_stack[i];
+    }
+    profile_used += depth + 1;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    const l_symbol *x = profile_buffer + *(const size_t *) a;
+    const l_symbol *y = profile_buffer + *(const size_t *) b;
+    l_symbol i;
+
+    for (i = 1; (i <= x[0]) && (i <= y[0]); i++) {
+        if (x[i] != y[i]) {
+            return (x[i] < y[i]) ? -1 : 1;
+        }
+    }
+    return (x[0] > y[0]) - (x[0] < y[0]);
+}
+
+static void write_stack(const l_symbol *sample, unsigned long count) {
+    l_symbol i;
+
+    if (sample[0] == 0) {
+        fprintf(profile_out, "[toplevel]");
+    }
+    for (i = 1; i <= sample[0]; i++) {
+        fprintf(profile_out, "%s%s", (i > 1) ? ";" : "", lookup(sample[i]));
+    }
+    fprintf(profile_out, " %lu\n", count);
+}
+
+static void write_profile(void) {
+    struct itimerval stop = { { 0, 0 }, { 0, 0 } };
+    size_t *samples, count = 0, offset, i, run;
+
+    setitimer(ITIMER_PROF, &stop, NULL);
+
+    for (offset = 0; offset < profile_used; offset += profile_buffer[offset] + 1) {
+        count++;
+    }
+    samples = malloc((count + 1) * sizeof(*samples));
+    if (samples != NULL) {
+        for (i = 0, offset = 0; i < count; offset += profile_buffer[offset] + 1) {
+            samples[i++] = offset;
+        }
+        qsort(samples, count, sizeof(*samples), compare_samples);
+
+        for (i = 0; i < count; i = run) {
+            for (run = i + 1; run < count; run++) {
+                if (compare_samples(samples + i, samples + run) != 0) {
+                    break;
+                }
+            }
+            write_stack(profile_buffer + samples[i], run - i);
+        }
+        free(samples);
+    }
+
+    if (profile_dropped > 0) {
+        fprintf(stderr, "Profile buffer full; dropped %lu samples.\n",
+                profile_dropped);
+    }
+    fclose(profile_out);
+}
+
+static bool start_profiler(const char *path) {
+    struct itimerval interval = {
+        { 0, PROFILE_INTERVAL_USEC }, { 0, PROFILE_INTERVAL_USEC }
+    };
+    struct sigaction action;
+
+    profile_buffer = malloc(PROFILE_BUFFER_WORDS * sizeof(*profile_buffer));
+    profile_out = fopen(path, "w");
+    if ((profile_buffer == NULL) || (profile_out == NULL)) {
+        return false;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = take_sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) {
+        return false;
+    }
+
+    atexit(write_profile);
+    return setitimer(ITIMER_PROF, &interval, NULL) == 0;
+}
+
+
+
+
+/*
+ * Phase timing.
+ *
+ * Cycles come from the time stamp counter (or, off x86, the monotonic
+ * clock in nanoseconds). On Linux, instructions retired, cache misses and
+ * branch misses come from perf_event_open(); they're reported as null
+ * where the kernel won't let us count them.
+ */
+
+enum counter { CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, COUNTERS };
+
+static const char *PHASE_NAMES[PHASES] = { "read", "eval", "print", "gc" };
+static const char *COUNTER_NAMES[COUNTERS] = {
+    "cycles", "instructions", "cache_misses", "branch_misses"
+};
+
+typedef uint64_t counters[COUNTERS];
+
+/* Totals charged to each phase since timing started. */
+static counters phase_totals[PHASES];
+/* Readings as of the last switch_phase(). */
+static counters last_reading;
+/* The group leader, or -1 without hardware counters. */
+static int perf_group = -1;
+
+#ifdef __linux__
+static int open_counter(uint64_t config, int group) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+static void open_counters(void) {
+#ifdef __linux__
+    int cache_misses, branch_misses;
+
+    perf_group = open_counter(PERF_COUNT_HW_INSTRUCTIONS, -1);
+    if (perf_group < 0) {
+        return;
+    }
+    cache_misses = open_counter(PERF_COUNT_HW_CACHE_MISSES, perf_group);
+    branch_misses = open_counter(PERF_COUNT_HW_BRANCH_MISSES, perf_group);
+    if ((cache_misses < 0) || (branch_misses < 0)) {
+        close(cache_misses);
+        close(branch_misses);
+        close(perf_group);
+        perf_group = -1;
+    }
+#endif
+}
+
+static void read_counters(counters now) {
+    /* With PERF_FORMAT_GROUP: how many, then each in the order opened. */
+    uint64_t group[1 + COUNTERS - 1] = { 0 };
+
+#if defined(__x86_64__) || defined(__i386__)
+    now[CYCLES] = __rdtsc();
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    now[CYCLES] = time.tv_sec * 1000000000ULL + time.tv_nsec;
+#endif
+
+    if ((perf_group >= 0) && (read(perf_group, group, sizeof(group)) != sizeof(group))) {
+        memset(group, 0, sizeof(group));
+    }
+    now[INSTRUCTIONS] = group[1];
+    now[CACHE_MISSES] = group[2];
+    now[BRANCH_MISSES] = group[3];
+}
+
+/* Starts charging time to phases, if it isn't already. */
+static void start_timing(void) {
+    static bool counters_opened = false;
+
+    if (timing) {
+        return;
+    }
+    if (!counters_opened) {
+        open_counters();
+        counters_opened = true;
+    }
+
+    timing = true;
+    read_counters(last_reading);
+}
+
+/* Charges everything since the last switch to the current phase. */
+static void switch_phase(int phase) {
+    counters now;
+    int i;
+
+    if (timing) {
+        read_counters(now);
+        for (i = 0; i < COUNTERS; i++) {
+            phase_totals[current_phase][i] += now[i] - last_reading[i];
+            last_reading[i] = now[i];
+        }
+    }
+    current_phase = phase;
+}
+
+/* Writes the counters for each phase in mask, less what they were before. */
+static void write_phases(counters before[PHASES], unsigned mask) {
+    const char *separator = "";
+    int phase, i;
+
+    fprintf(stderr, "{");
+    for (phase = 0; phase < PHASES; phase++) {
+        if (!(mask & (1u << phase))) {
+            continue;
+        }
+        fprintf(stderr, "%s\"%s\": {", separator, PHASE_NAMES[phase]);
+        for (i = 0; i < COUNTERS; i++) {
+            fprintf(stderr, "%s\"%s\": ", (i > 0) ? ", " : "", COUNTER_NAMES[i]);
+            if ((i == CYCLES) || (perf_group >= 0)) {
+                fprintf(stderr, "%llu", (unsigned long long)
+                        (phase_totals[phase][i] - before[phase][i]));
+            } else {
+                fprintf(stderr, "null");
+            }
+        }
+        fprintf(stderr, "}");
+        separator = ", ";
+    }
+    fprintf(stderr, "}\n");
+}
+
+/* One line of JSON for the expression just read, evaluated and printed. */
+static void report_expression_timing(void) {
+    static counters reported[PHASES];
+
+    switch_phase(PHASE_READ);
+    write_phases(reported, (1u << PHASES) - 1);
+    memcpy(reported, phase_totals, sizeof(reported));
+}
+
+/* (TIME expr): evaluates expr, reporting what evaluating and collecting
+ * garbage for it took. */
+static sexpr* time_evaluation(sexpr *expr, sexpr *env) {
+    counters before[PHASES];
+    sexpr *evaluation;
+    bool was_timing = timing;
+
+    start_timing();
+    switch_phase(PHASE_EVAL);
+    memcpy(before, phase_totals, sizeof(before));
+
+    evaluation = eval(expr, env);
+
+    switch_phase(PHASE_EVAL);
+    write_phases(before, (1u << PHASE_EVAL) | (1u << PHASE_GC));
+    timing = was_timing;
+
+    return evaluation;
+}
+
+
+
+
+/*
+ * JIT compiler.
+ *
+ * A lambda called often enough is compiled to x86-64 -- provided all it
+ * does is arithmetic on its (numeric) arguments, COND, and calling itself
+ * by name. Every value stays an unboxed double in the native code, which
+ * never allocates; only the final result is boxed. A call runs in the
+ * interpreter instead unless every argument is a number, the name still
+ * refers to the lambda, and no fuel budget needs each evaluation counted.
+ */
+
+#if JIT
+
+#define JIT_THRESHOLD   64      /* Interpreted calls before compiling. */
+#define JIT_MAX_ARGS    8       /* Passed in xmm0 to xmm7. */
+#define JIT_MAX_CODE    4096    /* Bytes of code per lambda. */
+#define JIT_ARENA_SIZE  (1 << 20)
+
+#define JIT_SELF        (-2)    /* jit_operator() for a recursive call. */
+#define JIT_NOT_CALLABLE (-1)
+
+/* Executable memory; code is never freed. */
+static unsigned char *jit_arena = NULL;
+static size_t jit_arena_used = 0;
+
+/* The state of compiling one lambda. */
+struct jit {
+    unsigned char code[JIT_MAX_CODE];
+    size_t length;
+    bool failed;
+
+    sexpr *formals;
+    int arity;
+    l_symbol name;
+    bool recursive;
+    int temps, max_temps; /* Stack slots for intermediate values. */
+    size_t body; /* Where a tail call of itself jumps back to. */
+};
+
+static void jit_emit(struct jit *j, const void *bytes, size_t length) {
+    if (j->length + length > JIT_MAX_CODE) {
+        j->failed = true;
+        return;
+    }
+    memcpy(j->code + j->length, bytes, length);
+    j->length += length;
+}
+
+#define EMIT(j, ...) do { \
+        const unsigned char bytes_[] = { __VA_ARGS__ }; \
+        jit_emit(j, bytes_, sizeof(bytes_)); \
+    } while (0)
+
+static void jit_emit_u32(struct jit *j, uint32_t value) {
+    jit_emit(j, &value, sizeof(value));
+}
+
+/* mov rax/rdx, imm64 */
+static void jit_emit_mov64(struct jit *j, unsigned char reg, uint64_t value) {
+    EMIT(j, 0x48, 0xb8 + reg);
+    jit_emit(j, &value, sizeof(value));
+}
+#define RAX 0
+#define RDX 2
+
+/* Formals come first in the frame, then temporaries. */
+static int32_t jit_slot(int slot) {
+    return -8 * (slot + 1);
+}
+
+/* movsd [rbp + slot], xmm */
+static void jit_store(struct jit *j, int xmm, int slot) {
+    EMIT(j, 0xf2, 0x0f, 0x11, 0x85 | (xmm << 3));
+    jit_emit_u32(j, jit_slot(slot));
+}
+
+/* movsd xmm, [rbp + slot] */
+static void jit_load(struct jit *j, int xmm, int slot) {
+    EMIT(j, 0xf2, 0x0f, 0x10, 0x85 | (xmm << 3));
+    jit_emit_u32(j, jit_slot(slot));
+}
+
+/* xmm0 = value */
+static void jit_constant(struct jit *j, l_number value) {
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    jit_emit_mov64(j, RAX, bits);
+    EMIT(j, 0x66, 0x48, 0x0f, 0x6e, 0xc0); /* movq xmm0, rax */
+}
+
+static int jit_push_temp(struct jit *j) {
+    int slot = j->arity + j->temps++;
+    if (j->temps > j->max_temps) {
+        j->max_temps = j->temps;
+    }
+    return slot;
+}
+
+/* A jmp (if condition is 0) or jcc; returns where to patch the target. */
+static size_t jit_jump(struct jit *j, unsigned char condition) {
+    if (condition == 0) {
+        EMIT(j, 0xe9);
+    } else {
+        EMIT(j, 0x0f, condition);
+    }
+    jit_emit_u32(j, 0);
+    return j->length - 4;
+}
+#define JA  0x87
+#define JBE 0x86
+#define JE  0x84
+#define JNE 0x85
+#define JP  0x8a
+#define JL  0x8c
+#define JAE 0x83
+
+/* Points the jump at the code about to be emitted. */
+static void jit_land(struct jit *j, size_t at) {
+    uint32_t offset = j->length - (at + 4);
+    if (!j->failed) {
+        memcpy(j->code + at, &offset, sizeof(offset));
+    }
+}
+
+static void jit_too_deep(void) {
+    exceed_budget("Recursion too deep.");
+}
+
+static int jit_formal(struct jit *j, l_symbol symbol) {
+    sexpr *current;
+    int i = 0;
+
+    for (current = j->formals; current != NIL; current = current->cdr, i++) {
+        if (current->car->symbol == symbol) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool jit_is_true(struct jit *j, sexpr *expr) {
+    if ((expr != NIL) && (expr->type == SYMBOL)) {
+        return (expr->symbol == T) && (jit_formal(j, T) < 0) && !redefined[T];
+    }
+    return (expr != NIL) && (expr->type == CONS)
+        && (expr->car != NIL) && (expr->car->type == SYMBOL)
+        && (expr->car->symbol == QUOTE)
+        && (expr->cdr != NIL) && (expr->cdr->type == CONS)
+        && (expr->cdr->car != NIL) && (expr->cdr->car->type == SYMBOL)
+        && (expr->cdr->car->symbol == T);
+}
+
+/* The built-in a call's operator refers to, or JIT_SELF. */
+static int jit_operator(struct jit *j, sexpr *op) {
+    sexpr *pair;
+
+    if ((op != NIL) && (op->type == BUILT_IN_FUNCTION)) {
+        /* Put there by partially_evaluate(). */
+        return redefined[op->builtin_symbol] ? JIT_NOT_CALLABLE : (int) op->builtin_symbol;
+    }
+
+    if ((op == NIL) || (op->type != SYMBOL) || (jit_formal(j, op->symbol) >= 0)) {
+        return JIT_NOT_CALLABLE;
+    }
+
+    if (op->symbol == j->name) {
+        j->recursive = true;
+        return JIT_SELF;
+    }
+
+    pair = find_binding(op->symbol, global);
+    if ((pair != NULL) && (pair->cdr != NIL)
+            && (pair->cdr->type == BUILT_IN_FUNCTION) && !pair->cdr->macro
+            && (pair->cdr->builtin_symbol == op->symbol) && !redefined[op->symbol]) {
+        return op->symbol;
+    }
+    return JIT_NOT_CALLABLE;
+}
+
+static void jit_value(struct jit *j, sexpr *expr, bool tail);
+
+/* xmm0 = xmm0 <op> arg, for addsd, subsd or mulsd. */
+static void jit_accumulate(struct jit *j, sexpr *arg, unsigned char op) {
+    int temp = jit_push_temp(j);
+
+    jit_store(j, 0, temp);
+    jit_value(j, arg, false);
+    jit_load(j, 1, temp);
+    EMIT(j, 0xf2, 0x0f, op, 0xc8); /* op xmm1, xmm0 */
+    EMIT(j, 0x66, 0x0f, 0x28, 0xc1); /* movapd xmm0, xmm1 */
+    j->temps--;
+}
+
+#define ADDSD   0x58
+#define MULSD   0x59
+#define SUBSD   0x5c
+
+/* A tail call loops, as it does in the interpreter: it takes up no more
+ * stack, nor call depth. */
+static void jit_call_self(struct jit *j, sexpr *args, bool tail) {
+    int first = j->arity + j->temps;
+    int i;
+
+    for (i = 0; args != NIL; args = args->cdr, i++) {
+        jit_value(j, args->car, false);
+        jit_store(j, 0, jit_push_temp(j));
+    }
+    for (i = 0; i < j->arity; i++) {
+        jit_load(j, tail ? 0 : i, first + i);
+        if (tail) {
+            jit_store(j, 0, i);
+        }
+    }
+    j->temps -= j->arity;
+
+    if (tail) {
+        EMIT(j, 0xe9); /* jmp to the body */
+        jit_emit_u32(j, (uint32_t) (j->body - (j->length + 4)));
+    } else {
+        EMIT(j, 0xe8); /* call the start of this code */
+        jit_emit_u32(j, -(int32_t) (j->length + 4));
+    }
+}
+
+/* Emits jumps to be taken if the test's truth is jump_if. */
+static void jit_test(struct jit *j, sexpr *test, bool jump_if, size_t *jumps, int *count) {
+    sexpr *args;
+    int op, temp;
+
+    if (jit_is_true(j, test)) {
+        if (jump_if) {
+            jumps[(*count)++] = jit_jump(j, 0);
+        }
+        return;
+    }
+
+    if ((test == NIL) || (test->type != CONS)) {
+        j->failed = true;
+        return;
+    }
+
+    op = jit_operator(j, test->car);
+    args = test->cdr;
+    if ((op == NOT) && (slength(args) == 1)) {
+        jit_test(j, args->car, !jump_if, jumps, count);
+        return;
+    } else if (((op != LT) && (op != GT) && (op != EQ)) || (slength(args) != 2)) {
+        j->failed = true;
+        return;
+    }
+
+    jit_value(j, args->car, false);
+    temp = jit_push_temp(j);
+    jit_store(j, 0, temp);
+    jit_value(j, args->cdr->car, false);
+    jit_load(j, 1, temp);
+    j->temps--;
+
+    /* First in xmm1, second in xmm0. */
+    if (op == LT) {
+        EMIT(j, 0x66, 0x0f, 0x2e, 0xc1); /* ucomisd xmm0, xmm1 */
+    } else {
+        EMIT(j, 0x66, 0x0f, 0x2e, 0xc8); /* ucomisd xmm1, xmm0 */
+    }
+
+    if (op != EQ) {
+        jumps[(*count)++] = jit_jump(j, jump_if ? JA : JBE);
+    } else if (jump_if) {
+        /* Unordered means not equal. */
+        size_t unordered = jit_jump(j, JP);
+        jumps[(*count)++] = jit_jump(j, JE);
+        jit_land(j, unordered);
+    } else {
+        jumps[(*count)++] = jit_jump(j, JP);
+        jumps[(*count)++] = jit_jump(j, JNE);
+    }
+}
+
+#define JIT_MAX_CLAUSES 64
+
+/* A COND must end in a clause that's always taken, so it has a number. */
+static void jit_cond(struct jit *j, sexpr *clauses, bool tail) {
+    size_t ends[JIT_MAX_CLAUSES], next[2 * JIT_MAX_CLAUSES];
+    int end_count = 0, next_count, i;
+    sexpr *clause;
+
+    for (; clauses != NIL; clauses = clauses->cdr) {
+        clause = clauses->car;
+        if ((clauses->type != CONS) || (clause == NIL) || (clause->type != CONS)
+                || (slength(clause) != 2) || (end_count == JIT_MAX_CLAUSES)) {
+            break;
+        }
+
+        if (jit_is_true(j, clause->car)) {
+            jit_value(j, clause->cdr->car, tail);
+            for (i = 0; i < end_count; i++) {
+                jit_land(j, ends[i]);
+            }
+            return;
+        }
+
+        next_count = 0;
+        jit_test(j, clause->car, false, next, &next_count);
+        jit_value(j, clause->cdr->car, tail);
+        ends[end_count++] = jit_jump(j, 0);
+        for (i = 0; i < next_count; i++) {
+            jit_land(j, next[i]);
+        }
+    }
+
+    j->failed = true;
+}
+
+/* xmm0 = the value of expr; or, if it's a call of itself in tail position,
+ * a jump that never comes back. */
+static void jit_value(struct jit *j, sexpr *expr, bool tail) {
+    sexpr *args, *current;
+    int op, argc, slot;
+
+    if (j->failed || (expr == NIL)) {
+        j->failed = true;
+        return;
+    }
+
+    if (expr->type == NUMBER) {
+        jit_constant(j, expr->number);
+        return;
+    } else if (expr->type == SYMBOL) {
+        if ((slot = jit_formal(j, expr->symbol)) < 0) {
+            j->failed = true;
+        } else {
+            jit_load(j, 0, slot);
+        }
+        return;
+    } else if (expr->type != CONS) {
+        j->failed = true;
+        return;
+    }
+
+    args = expr->cdr;
+    for (argc = 0, current = args; (current != NIL) && (current->type == CONS); current = current->cdr) {
+        argc++;
+    }
+    if (current != NIL) {
+        j->failed = true;
+        return;
+    }
+
+    if ((expr->car != NIL) && (expr->car->type == SYMBOL) && is_special_form(expr->car->symbol)) {
+        if (expr->car->symbol == COND) {
+            jit_cond(j, args, tail);
+        } else if ((expr->car->symbol == QUOTE) && (argc == 1)
+                && (args->car != NIL) && (args->car->type == NUMBER)) {
+            jit_constant(j, args->car->number);
+        } else {
+            j->failed = true;
+        }
+        return;
+    }
+
+    op = jit_operator(j, expr->car);
+    switch (op) {
+        case PLUS:
+        case MUL:
+            /* Exactly as plus() and mul() do it. */
+            jit_constant(j, (op == PLUS) ? 0 : 1);
+            for (current = args; current != NIL; current = current->cdr) {
+                jit_accumulate(j, current->car, (op == PLUS) ? ADDSD : MULSD);
+            }
+            break;
+
+        case NEG:
+            if (argc == 0) {
+                j->failed = true;
+                break;
+            }
+            jit_value(j, args->car, false);
+            if (argc == 1) {
+                /* Flip the sign bit, as neg() does. */
+                jit_emit_mov64(j, RAX, 1ull << 63);
+                EMIT(j, 0x66, 0x48, 0x0f, 0x6e, 0xc8); /* movq xmm1, rax */
+                EMIT(j, 0x66, 0x0f, 0x57, 0xc1); /* xorpd xmm0, xmm1 */
+            }
+            for (current = args->cdr; current != NIL; current = current->cdr) {
+                jit_accumulate(j, current->car, SUBSD);
+            }
+            break;
+
+        case JIT_SELF:
+            if (argc != j->arity) {
+                j->failed = true;
+                break;
+            }
+            jit_call_self(j, args, tail);
+            break;
+
+        default:
+            j->failed = true;
+    }
+}
+
+/* Copies the code somewhere it can be run; NULL if there's no room. */
+static native_entry jit_install(struct jit *j) {
+    unsigned char *code;
+    size_t start = (jit_arena_used + 15) & ~(size_t) 15;
+
+    if (jit_arena == NULL) {
+        jit_arena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_EXEC,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (jit_arena == MAP_FAILED) {
+            jit_arena = NULL;
+            return NULL;
+        }
+    }
+
+    if ((start + j->length > JIT_ARENA_SIZE)
+            || (mprotect(jit_arena, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE) != 0)) {
+        return NULL;
+    }
+    code = jit_arena + start;
+    memcpy(code, j->code, j->length);
+    jit_arena_used = start + j->length;
+    mprotect(jit_arena, JIT_ARENA_SIZE, PROT_READ | PROT_EXEC);
+
+    return (native_entry) code;
+}
+
+static native_entry jit_compile(sexpr *func, sexpr *body, int *arity, bool *recursive) {
+    struct jit j;
+    sexpr *current;
+    size_t frame_size;
+    int i;
+
+    j.length = 0;
+    j.failed = false;
+    j.formals = func->cdr->car;
+    j.arity = 0;
+    j.name = closure_names[func - heap] ? closure_names[func - heap] - 1 : (l_symbol) -1;
+    j.recursive = false;
+    j.temps = j.max_temps = 0;
+
+    for (current = j.formals; current != NIL; current = current->cdr) {
+        if ((current->type != CONS) || (current->car == NIL)
+                || (current->car->type != SYMBOL) || (++j.arity > JIT_MAX_ARGS)) {
+            return NULL;
+        }
+    }
+
+    EMIT(&j, 0x55); /* push rbp */
+    EMIT(&j, 0x48, 0x89, 0xe5); /* mov rbp, rsp */
+    EMIT(&j, 0x48, 0x81, 0xec); /* sub rsp, imm32 */
+    frame_size = j.length;
+    jit_emit_u32(&j, 0);
+
+    /* push_call(), inline. */
+    jit_emit_mov64(&j, RAX, (uintptr_t) &call_depth);
+    EMIT(&j, 0x8b, 0x08); /* mov ecx, [rax] */
+    jit_emit_mov64(&j, RDX, (uintptr_t) &depth_limit);
+    EMIT(&j, 0x3b, 0x0a); /* cmp ecx, [rdx] */
+    size_t shallow = jit_jump(&j, JL);
+    jit_emit_mov64(&j, RAX, (uintptr_t) jit_too_deep);
+    EMIT(&j, 0xff, 0xd0); /* call rax */
+    jit_land(&j, shallow);
+    EMIT(&j, 0x81, 0xf9); /* cmp ecx, imm32 */
+    jit_emit_u32(&j, MAX_CALL_DEPTH);
+    size_t unrecorded = jit_jump(&j, JAE);
+    jit_emit_mov64(&j, RDX, (uintptr_t) call_stack);
+    EMIT(&j, 0xc7, 0x04, 0x8a); /* mov dword [rdx + rcx*4], imm32 */
+    jit_emit_u32(&j, (j.name != (l_symbol) -1) ? j.name : LAMBDA);
+    jit_land(&j, unrecorded);
+    EMIT(&j, 0xff, 0xc1); /* inc ecx */
+    EMIT(&j, 0x89, 0x08); /* mov [rax], ecx */
+
+    for (i = 0; i < j.arity; i++) {
+        jit_store(&j, i, i);
+    }
+
+    j.body = j.length;
+    jit_value(&j, body, true);
+
+    jit_emit_mov64(&j, RAX, (uintptr_t) &call_depth);
+    EMIT(&j, 0xff, 0x08); /* dec dword [rax] */
+    EMIT(&j, 0xc9); /* leave */
+    EMIT(&j, 0xc3); /* ret */
+
+    if (j.failed) {
+        return NULL;
+    }
+
+    /* Keeps the stack 16-byte aligned at every call. */
+    uint32_t size = ((j.arity + j.max_temps) * 8 + 15) & ~15u;
+    memcpy(j.code + frame_size, &size, sizeof(size));
+
+    *arity = j.arity;
+    *recursive = j.recursive;
+    return jit_install(&j);
+}
+
+/* Calls func natively if it's compiled (or now worth compiling) and the
+ * guards hold. Otherwise returns NULL, and the interpreter does it. */
+static sexpr *jit_call(sexpr *func, sexpr *args) {
+    struct free_symbols *info;
+    double argv[JIT_MAX_ARGS] = { 0 };
+    sexpr *pair;
+    int i;
+
+    if ((func->car == NIL) || !IS_HEAP_CELL(func->car) || (func->cdr->cdr != NIL)
+            || (fuel_deadline != ULONG_MAX)) {
+        return NULL;
+    }
+
+    info = free_symbol_cache[func->car - heap];
+    if ((info == NULL) || (info->formals != func->cdr->car)) {
+        return NULL;
+    }
+
+    if (info->jit.epoch != optimization_epoch) {
+        if (++info->jit.calls < JIT_THRESHOLD) {
+            return NULL;
+        }
+        info->jit.calls = 0;
+        info->jit.epoch = optimization_epoch;
+        info->jit.name = closure_names[func - heap] - 1;
+        info->jit.entry = jit_compile(func, closure_body(func),
+                &info->jit.arity, &info->jit.recursive);
+    }
+
+    if (info->jit.entry == NULL) {
+        return NULL;
+    }
+
+    /* The code calls itself wherever the lambda called its name. */
+    if (info->jit.recursive) {
+        pair = find_binding(info->jit.name, global);
+        if ((pair == NULL) || (pair->cdr != func)) {
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < info->jit.arity; i++, args = args->cdr) {
+        if ((args == NIL) || (args->car == NIL) || (args->car->type != NUMBER)) {
+            return NULL;
+        }
+        argv[i] = args->car->number;
+    }
+    if (args != NIL) {
+        return NULL;
+    }
+
+    return new_number(info->jit.entry(argv[0], argv[1], argv[2], argv[3],
+                argv[4], argv[5], argv[6], argv[7]));
+}
+
+#else
+
+static sexpr *jit_call(sexpr *func, sexpr *args) {
+    return NULL;
+}
+
+#endif /* JIT */
+
+
+
+/*
+ * Compiler.
+ *
+ *      lersp --compile prog.lsp -o prog.c
+ *      cc -O2 -DLERSP_NO_MAIN -o prog prog.c lersp.c -lm -pthread
+ *
+ * Each top-level (LABEL name (LAMBDA formals body)) becomes a C function,
+ * and each other top-level expression a function that evaluates it. Values
+ * are still boxed cells and the built-ins still do all the work, but
+ * nothing is read or looked up at run time: arguments and LET variables
+ * are C variables, built-ins and other compiled functions are called
+ * directly, and a tail call of a function to itself is a loop.
+ *
+ * Whatever can't be compiled -- lambdas that aren't applied on the spot,
+ * macro definitions, TIME, rebinding a name -- is kept as text and
+ * evaluated when the program gets to it. Macros are expanded at compile
+ * time, so DEFMACROs, and LABELed lambdas that macros might use, are also
+ * evaluated at compile time.
+ */
+
+#define MAX_VARIABLES   256
+#define MAX_FORMS       4096
+
+struct compiler {
+    FILE *out; /* The function being compiled. */
+    int indent;
+    bool failed;
+    int temps;
+    int self; /* The function being compiled, or -1 for a top-level form. */
+    bool looped; /* It has called itself in tail position. */
+
+    /* Variables in scope, innermost last, and the temps that hold them. */
+    l_symbol variables[MAX_VARIABLES];
+    int variable_temps[MAX_VARIABLES];
+    int variable_count;
+
+    /* Indices into the generated sym[] and bif[], or -1. */
+    int symbol_slot[MAX_NAMES];
+    int builtin_slot[MAX_NAMES];
+    int symbol_count, builtin_count;
+
+    /* Statements that fill in lit[]. */
+    FILE *constants;
+    int constant_count;
+
+    /* By name: the compiled function f<n>, or -1, and its arity. */
+    int function[MAX_NAMES];
+    int arity[MAX_NAMES];
+    /* How many times each name is LABELed or DEFMACROed, anywhere. */
+    int bindings[MAX_NAMES];
+};
+
+static void emit(struct compiler *c, const char *format, ...) {
+    va_list args;
+
+    fprintf(c->out, "%*s", 4 * c->indent, "");
+    va_start(args, format);
+    vfprintf(c->out, format, args);
+    va_end(args);
+    fputc('\n', c->out);
+}
+
+static void write_c_string(FILE *out, const char *text, size_t length) {
+    size_t i;
+
+    fputc('"', out);
+    for (i = 0; i < length; i++) {
+        if ((text[i] == '"') || (text[i] == '\\')) {
+            fprintf(out, "\\%c", text[i]);
+        } else if (isprint((unsigned char) text[i])) {
+            fputc(text[i], out);
+        } else {
+            fprintf(out, "\\%03o", (unsigned char) text[i]);
+        }
+    }
+    fputc('"', out);
+}
+
+/* Writes expr so that the reader gives it back; false if it can't. */
+static bool write_datum(FILE *out, sexpr *expr, int depth) {
+    const char *name, *text;
+    size_t i, length;
+
+    if (expr == NIL) {
+        fputs("()", out);
+        return true;
+    } else if (depth > 10000) {
+        return false;
+    }
+
+    switch (expr->type) {
+        case NUMBER:
+            /* The reader can't do signs, infinities or NaN. */
+            if (!(expr->number >= 0) || signbit(expr->number) || (expr->number > DBL_MAX)) {
+                return false;
+            }
+            fprintf(out, "%.17g", expr->number);
+            return true;
+
+        case SYMBOL:
+            name = lookup(expr->symbol);
+            if ((name[0] == '\0') || isdigit((unsigned char) name[0]) || !strcmp(name, ".")) {
+                return false;
+            }
+            for (i = 0; name[i] != '\0'; i++) {
+                if (!is_symbol_char(name[i]) || islower((unsigned char) name[i])) {
+                    return false;
+                }
+            }
+            fputs(name, out);
+            return true;
+
+        case STRING:
+            text = string_bytes(expr);
+            length = string_length_of(expr);
+            fputc('"', out);
+            for (i = 0; i < length; i++) {
+                if ((text[i] == '"') || (text[i] == '\\')) {
+                    fputc('\\', out);
+                }
+                fputc(text[i], out);
+            }
+            fputc('"', out);
+            return true;
+
+        case CONS:
+            fputc('(', out);
+            for (; expr->type == CONS; expr = expr->cdr) {
+                if (!write_datum(out, expr->car, depth + 1)) {
+                    return false;
+                }
+                if (expr->cdr == NIL) {
+                    break;
+                }
+                fputc(' ', out);
+            }
+            if (expr->type != CONS) {
+                fputs(". ", out);
+                if (!write_datum(out, expr, depth + 1)) {
+                    return false;
+                }
+            }
+            fputc(')', out);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/* expr as text the reader gives back, as a malloc'd string, or NULL. */
+static char *datum_text(sexpr *expr) {
+    char *text = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&text, &size);
+    bool ok;
+
+    assert(out != NULL);
+    ok = write_datum(out, expr, 0);
+    fclose(out);
+
+    if (!ok) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+static int symbol_slot(struct compiler *c, l_symbol symbol) {
+    if (c->symbol_slot[symbol] < 0) {
+        c->symbol_slot[symbol] = c->symbol_count++;
+    }
+    return c->symbol_slot[symbol];
+}
+
+/* A built-in the program never rebinds; see builtin_function(). */
+static int builtin_slot(struct compiler *c, l_symbol symbol) {
+    size_t i;
+
+    if (c->bindings[symbol] > 0) {
+        return -1;
+    }
+    if (c->builtin_slot[symbol] < 0) {
+        for (i = 0; i < sizeof(BUILT_INS) / sizeof(BUILT_INS[0]); i++) {
+            if ((BUILT_INS[i].identifier == symbol) && !BUILT_INS[i].macro) {
+                c->builtin_slot[symbol] = c->builtin_count++;
+                break;
+            }
+        }
+    }
+    return c->builtin_slot[symbol];
+}
+
+static int find_variable(struct compiler *c, l_symbol symbol) {
+    int i;
+
+    for (i = c->variable_count - 1; i >= 0; i--) {
+        if (c->variables[i] == symbol) {
+            return c->variable_temps[i];
+        }
+    }
+    return -1;
+}
+
+static bool bind_variable(struct compiler *c, sexpr *name, int temp) {
+    if ((name == NIL) || (name->type != SYMBOL) || (c->variable_count == MAX_VARIABLES)) {
+        c->failed = true;
+        return false;
+    }
+    c->variables[c->variable_count] = name->symbol;
+    c->variable_temps[c->variable_count++] = temp;
+    return true;
+}
+
+/* The length of a proper list, or -1. */
+static int proper_length(sexpr *list) {
+    int length = 0;
+
+    for (; (list != NIL) && (list->type == CONS); list = list->cdr) {
+        length++;
+    }
+    return (list == NIL) ? length : -1;
+}
+
+static int compile_expr(struct compiler *c, sexpr *expr, bool tail);
+
+static int compile_constant(struct compiler *c, sexpr *value) {
+    int constant = c->constant_count++;
+    int temp = c->temps++;
+    char *text;
+
+    if ((value != NIL) && (value->type == NUMBER)) {
+        if (!(fabs(value->number) <= DBL_MAX)) {
+            c->failed = true;
+            return temp;
+        }
+        fprintf(c->constants, "    lit[%d] = keep(new_number(%a));\n", constant, value->number);
+    } else if ((text = datum_text(value)) != NULL) {
+        fprintf(c->constants, "    lit[%d] = read_constant(", constant);
+        write_c_string(c->constants, text, strlen(text));
+        fprintf(c->constants, ");\n");
+        free(text);
+    } else {
+        c->failed = true;
+    }
+
+    emit(c, "sexpr *t%d = lit[%d];", temp, constant);
+    return temp;
+}
+
+/* The temps holding the arguments, comma-separated. */
+static void write_temps(FILE *out, const int *temps, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        fprintf(out, "%st%d", (i > 0) ? ", " : "", temps[i]);
+    }
+}
+
+static int compile_cond(struct compiler *c, sexpr *clauses, bool tail) {
+    int result = c->temps++, test, value, open = 0;
+    sexpr *clause;
+
+    emit(c, "sexpr *t%d = NIL;", result);
+
+    for (; clauses != NIL; clauses = clauses->cdr) {
+        clause = clauses->car;
+        if (proper_length(clause) != 2) {
+            c->failed = true;
+            break;
+        }
+
+        if ((clause->car != NIL) && (clause->car->type == SYMBOL) && (clause->car->symbol == T)
+                && (c->bindings[T] == 0) && (find_variable(c, T) < 0)) {
+            /* Always taken. */
+            value = compile_expr(c, clause->cdr->car, tail);
+            emit(c, "t%d = t%d;", result, value);
+            break;
+        }
+
+        test = compile_expr(c, clause->car, false);
+        emit(c, "if (is_truthy(t%d)) {", test);
+        c->indent++;
+        value = compile_expr(c, clause->cdr->car, tail);
+        emit(c, "t%d = t%d;", result, value);
+        c->indent--;
+        emit(c, "} else {");
+        c->indent++;
+        open++;
+    }
 
-static void insert_initial_environment(void) {
+    while (open-- > 0) {
+        c->indent--;
+        emit(c, "}");
+    }
+    return result;
+}
+
+/* ((LAMBDA (names...) body) values...) -- what LET expands to. */
+static int compile_let(struct compiler *c, sexpr *lambda, sexpr *args, bool tail) {
+    int argc = proper_length(args), count = c->variable_count;
+    int values[argc > 0 ? argc : 1];
+    sexpr *name;
+    int i, result;
+
+    if ((proper_length(lambda) != 3) || (proper_length(lambda->cdr->car) != argc)) {
+        c->failed = true;
+        return 0;
+    }
+
+    for (i = 0; args != NIL; args = args->cdr, i++) {
+        values[i] = compile_expr(c, args->car, false);
+    }
+    for (i = 0, name = lambda->cdr->car; name != NIL; name = name->cdr, i++) {
+        bind_variable(c, name->car, values[i]);
+    }
+
+    result = compile_expr(c, lambda->cdr->cdr->car, tail);
+    c->variable_count = count;
+    return result;
+}
+
+static int compile_call(struct compiler *c, sexpr *expr, bool tail) {
+    sexpr *head = expr->car, *args = expr->cdr;
+    int argc = proper_length(args);
+    int values[argc > 0 ? argc : 1];
+    int callee = -1, result, slot, i;
+    /* Set whenever callee < 0: the operator is a name, and not a local. */
+    l_symbol symbol = 0;
+
+    if (argc < 0) {
+        c->failed = true;
+        return 0;
+    }
+
+    if ((head != NIL) && (head->type == SYMBOL)) {
+        symbol = head->symbol;
+        callee = find_variable(c, symbol);
+    } else {
+        /* Like eval(), the operator comes first. */
+        callee = compile_expr(c, head, false);
+    }
+
+    for (i = 0; args != NIL; args = args->cdr, i++) {
+        values[i] = compile_expr(c, args->car, false);
+    }
+    result = c->temps++;
+
+    if ((callee < 0) && (c->function[symbol] >= 0) && (c->arity[symbol] == argc)) {
+        if (tail && (c->function[symbol] == c->self)) {
+            /* Copy first: an argument may be another argument's variable. */
+            for (i = 0; i < argc; i++) {
+                emit(c, "sexpr *t%d = t%d;", c->temps + i, values[i]);
+            }
+            for (i = 0; i < argc; i++) {
+                emit(c, "t%d = t%d;", i, c->temps + i);
+            }
+            c->temps += argc;
+            emit(c, "sexpr *t%d = NIL;", result);
+            emit(c, "goto top;");
+            c->looped = true;
+            return result;
+        }
+
+        fprintf(c->out, "%*ssexpr *t%d = f%d(", 4 * c->indent, "", result, c->function[symbol]);
+        write_temps(c->out, values, argc);
+        fprintf(c->out, ");\n");
+    } else if ((callee < 0) && ((slot = builtin_slot(c, symbol)) >= 0)) {
+        fprintf(c->out, "%*ssexpr *t%d = bif[%d](%d, ", 4 * c->indent, "", result, slot, argc);
+        if (argc > 0) {
+            fprintf(c->out, "(sexpr *[]){ ");
+            write_temps(c->out, values, argc);
+            fprintf(c->out, " });\n");
+        } else {
+            fprintf(c->out, "NULL);\n");
+        }
+    } else {
+        if (callee < 0) {
+            callee = c->temps++;
+            emit(c, "sexpr *t%d = assoc(sym[%d], NIL);", callee, symbol_slot(c, symbol));
+        }
+        fprintf(c->out, "%*ssexpr *t%d = apply(t%d, ", 4 * c->indent, "", result, callee);
+        for (i = 0; i < argc; i++) {
+            fprintf(c->out, "cons(t%d, ", values[i]);
+        }
+        fprintf(c->out, "NIL");
+        for (i = 0; i < argc; i++) {
+            fputc(')', c->out);
+        }
+        fprintf(c->out, ");\n");
+    }
+
+    return result;
+}
+
+/* Emits code that evaluates expr; returns the temp that holds its value. */
+static int compile_expr(struct compiler *c, sexpr *expr, bool tail) {
+    sexpr *head;
+    int temp;
+
+    if (c->failed) {
+        return 0;
+    }
+
+    if (expr == NIL) {
+        temp = c->temps++;
+        emit(c, "sexpr *t%d = NIL;", temp);
+        return temp;
+    }
+
+    switch (expr->type) {
+        case NUMBER:
+        case STRING:
+            return compile_constant(c, expr);
+
+        case SYMBOL:
+            if ((temp = find_variable(c, expr->symbol)) >= 0) {
+                return temp;
+            }
+            temp = c->temps++;
+            emit(c, "sexpr *t%d = assoc(sym[%d], NIL);", temp, symbol_slot(c, expr->symbol));
+            return temp;
+
+        case CONS:
+            break;
+
+        default:
+            c->failed = true;
+            return 0;
+    }
+
+    head = expr->car;
+    if ((head != NIL) && (head->type == SYMBOL) && is_special_form(head->symbol)) {
+        if ((head->symbol == QUOTE) && (proper_length(expr->cdr) == 1)) {
+            return compile_constant(c, expr->cdr->car);
+        } else if ((head->symbol == COND) && (proper_length(expr->cdr) >= 0)) {
+            return compile_cond(c, expr->cdr, tail);
+        }
+        c->failed = true;
+        return 0;
+    }
+
+    if ((head != NIL) && (head->type == CONS) && (head->car != NIL)
+            && (head->car->type == SYMBOL) && (head->car->symbol == LAMBDA)) {
+        return compile_let(c, head, expr->cdr, tail);
+    }
+
+    return compile_call(c, expr, tail);
+}
+
+/* Compiles into a buffer of its own, so a failure leaves nothing behind. */
+static void start_function(struct compiler *c, char **text, size_t *size) {
+    c->out = open_memstream(text, size);
+    assert(c->out != NULL);
+    c->indent = 1;
+    c->failed = false;
+    c->variable_count = 0;
+}
+
+static bool finish_function(struct compiler *c, char **text, FILE *out) {
+    fclose(c->out);
+    if (!c->failed) {
+        fputs(*text, out);
+    }
+    free(*text);
+    return !c->failed;
+}
+
+/* (LABEL name (LAMBDA formals body)) as f<index>. */
+static bool compile_function(struct compiler *c, int index, l_symbol name,
+        sexpr *formals, sexpr *body, FILE *out) {
+    char *text = NULL;
+    size_t size = 0;
+    int arity = proper_length(formals), i, result;
+
+    c->self = index;
+    c->looped = false;
+    c->temps = arity;
+    start_function(c, &text, &size);
+    for (i = 0; formals != NIL; formals = formals->cdr, i++) {
+        bind_variable(c, formals->car, i);
+    }
+    result = compile_expr(c, body, true);
+    emit(c, "pop_frame(frame);");
+    emit(c, "return t%d;", result);
+    fprintf(c->out, "}\n\n");
+
+    /* The body is done, so we know whether it needs the label. */
+    if (!c->failed) {
+        fprintf(out, "static sexpr *f%d(", index);
+        for (i = 0; i < arity; i++) {
+            fprintf(out, "%ssexpr *t%d", (i > 0) ? ", " : "", i);
+        }
+        fprintf(out, "%s) {\n", (arity > 0) ? "" : "void");
+        fprintf(out, "    int frame = push_frame(sym[%d]);\n", symbol_slot(c, name));
+        if (c->looped) {
+            fprintf(out, "top: ;\n");
+        }
+    }
+    return finish_function(c, &text, out);
+}
+
+/* A top-level expression as form<index>. */
+static bool compile_form(struct compiler *c, int index, sexpr *form, FILE *out) {
+    char *text = NULL;
+    size_t size = 0;
+    int result;
+
+    c->self = -1;
+    c->temps = 0;
+    start_function(c, &text, &size);
+    fprintf(c->out, "static sexpr *form%d(void) {\n", index);
+    result = compile_expr(c, form, false);
+    emit(c, "return t%d;", result);
+    fprintf(c->out, "}\n\n");
+
+    return finish_function(c, &text, out);
+}
+
+/* Counts the LABELs and DEFMACROs of each name, outside of QUOTE. */
+static void count_bindings(struct compiler *c, sexpr *expr) {
+    if ((expr == NIL) || (expr->type != CONS)) {
+        return;
+    }
+    if ((expr->car != NIL) && (expr->car->type == SYMBOL)) {
+        if (expr->car->symbol == QUOTE) {
+            return;
+        }
+        if (((expr->car->symbol == LABEL) || (expr->car->symbol == DEFMACRO))
+                && (expr->cdr != NIL) && (expr->cdr->type == CONS)
+                && (expr->cdr->car != NIL) && (expr->cdr->car->type == SYMBOL)) {
+            c->bindings[expr->cdr->car->symbol]++;
+        }
+    }
+    for (; (expr != NIL) && (expr->type == CONS); expr = expr->cdr) {
+        count_bindings(c, expr->car);
+    }
+}
+
+/* (LABEL name (LAMBDA formals body)), with formals a list of symbols. */
+static bool is_function_definition(sexpr *form) {
+    sexpr *lambda, *formals;
+
+    if ((proper_length(form) != 3) || (form->car->type != SYMBOL)
+            || (form->car->symbol != LABEL)
+            || (form->cdr->car == NIL) || (form->cdr->car->type != SYMBOL)) {
+        return false;
+    }
+
+    lambda = form->cdr->cdr->car;
+    if ((proper_length(lambda) != 3) || (lambda->car == NIL)
+            || (lambda->car->type != SYMBOL) || (lambda->car->symbol != LAMBDA)
+            || (proper_length(lambda->cdr->car) < 0)) {
+        return false;
+    }
+
+    for (formals = lambda->cdr->car; formals != NIL; formals = formals->cdr) {
+        if ((formals->car == NIL) || (formals->car->type != SYMBOL)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool is_macro_definition(sexpr *form) {
+    return (form != NIL) && (form->type == CONS) && (form->car != NIL)
+        && (form->car->type == SYMBOL) && (form->car->symbol == DEFMACRO);
+}
+
+/* Everything the code generator needs to know about the program. */
+struct program {
+    sexpr *forms[MAX_FORMS];
+    char *texts[MAX_FORMS]; /* Before macros were expanded. */
+    bool expanded[MAX_FORMS]; /* Otherwise it raised; leave it to run time. */
+    int count;
+};
+
+/* (LABEL name (LAMBDA ...)): nothing happens when it's evaluated but that. */
+static bool is_lambda_definition(sexpr *form) {
+    return (proper_length(form) == 3) && (form->car->type == SYMBOL)
+        && (form->car->symbol == LABEL)
+        && (form->cdr->car != NIL) && (form->cdr->car->type == SYMBOL)
+        && (proper_length(form->cdr->cdr->car) == 3)
+        && (form->cdr->cdr->car->car != NIL)
+        && (form->cdr->cdr->car->car->type == SYMBOL)
+        && (form->cdr->cdr->car->car->symbol == LAMBDA);
+}
+
+/* Reads the program, evaluating and expanding macros as it goes. */
+static bool read_program(const char *source, struct program *program) {
+    FILE *in = fopen(source, "r");
+    sexpr *form;
+    volatile bool reading = true;
+
+    if (in == NULL) {
+        fprintf(stderr, "Could not open %s\n", source);
+        return false;
+    }
+
+    program->count = 0;
+    if (setjmp(top_level_exception) != NOT_PARSED) {
+        if (reading || (program->texts[program->count] == NULL)) {
+            fprintf(stderr, "%s: could not compile form %d.\n", source, program->count + 1);
+            fclose(in);
+            return false;
+        }
+        program->expanded[program->count++] = false;
+    }
+    call_depth = 0;
+
+    for (;;) {
+        reading = true;
+        if ((form = l_read_from(in)) == EOF_OBJECT) {
+            break;
+        } else if (program->count == MAX_FORMS) {
+            fprintf(stderr, "%s: too many forms.\n", source);
+            fclose(in);
+            return false;
+        }
+        reading = false;
+
+        program->forms[program->count] = keep(form);
+        program->texts[program->count] = datum_text(form);
+
+        if (is_macro_definition(form) || is_lambda_definition(form)) {
+            eval(form, global);
+        }
+        expand_macros(form);
+        program->expanded[program->count++] = true;
+    }
+
+    fclose(in);
+    return true;
+}
+
+static bool compile_program(const char *source, const char *output) {
+    static struct program program;
+    static struct compiler c;
+    bool compiled[MAX_FORMS];
+    char *functions = NULL, *forms = NULL, *constants = NULL;
+    size_t functions_size = 0, forms_size = 0, constants_size = 0;
+    FILE *function_out, *form_out, *out;
+    char *text;
+    l_symbol name;
+    int i, pass, count;
+
+    if (!read_program(source, &program)) {
+        return false;
+    }
+
+    memset(&c, 0, sizeof(c));
+    for (i = 0; i < program.count; i++) {
+        count_bindings(&c, program.forms[i]);
+    }
+
+    /*
+     * The first pass finds out which functions compile. Whether one does
+     * doesn't depend on how calls to others are made, so the second pass
+     * can call exactly those directly.
+     */
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < MAX_NAMES; i++) {
+            c.symbol_slot[i] = c.builtin_slot[i] = c.function[i] = -1;
+        }
+        c.symbol_count = c.builtin_count = c.constant_count = 0;
+        for (i = 0; i < program.count; i++) {
+            if (program.expanded[i] && is_function_definition(program.forms[i])
+                    && ((pass == 0) || compiled[i])) {
+                name = program.forms[i]->cdr->car->symbol;
+                if (c.bindings[name] == 1) {
+                    c.function[name] = i;
+                    c.arity[name] = proper_length(program.forms[i]->cdr->cdr->car->cdr->car);
+                }
+            }
+        }
+
+        free(functions);
+        free(forms);
+        free(constants);
+        functions = forms = constants = NULL;
+        function_out = open_memstream(&functions, &functions_size);
+        form_out = open_memstream(&forms, &forms_size);
+        c.constants = open_memstream(&constants, &constants_size);
+
+        for (i = 0; i < program.count; i++) {
+            sexpr *form = program.forms[i];
+
+            compiled[i] = false;
+            if (!program.expanded[i]) {
+                /* Evaluated from its text. */
+            } else if (is_function_definition(form)) {
+                name = form->cdr->car->symbol;
+                /* It's bound to the lambda, as LABEL would, which runs w<i>. */
+                text = datum_text(form->cdr->cdr->car);
+                compiled[i] = (text != NULL) && (c.function[name] == i)
+                    && compile_function(&c, i, name, form->cdr->cdr->car->cdr->car,
+                            form->cdr->cdr->car->cdr->cdr->car, function_out);
+                if (compiled[i]) {
+                    fprintf(c.constants, "    lit[%d] = read_constant(", c.constant_count);
+                    write_c_string(c.constants, text, strlen(text));
+                    fprintf(c.constants, ");\n");
+                    fprintf(form_out, "static sexpr *form%d(void) {\n"
+                            "    return define_compiled(sym[%d], w%d, lit[%d]);\n}\n\n",
+                            i, symbol_slot(&c, name), i, c.constant_count++);
+                }
+                free(text);
+            } else if (!is_macro_definition(form)) {
+                compiled[i] = compile_form(&c, i, form, form_out);
+            }
+
+            if (!compiled[i]) {
+                if (program.texts[i] == NULL) {
+                    fprintf(stderr, "%s: can't compile form %d.\n", source, i + 1);
+                    return false;
+                }
+                fprintf(c.constants, "    lit[%d] = read_constant(", c.constant_count);
+                write_c_string(c.constants, program.texts[i], strlen(program.texts[i]));
+                fprintf(c.constants, ");\n");
+                fprintf(form_out, "static sexpr *form%d(void) {\n"
+                        "    return eval(lit[%d], NIL);\n}\n\n", i, c.constant_count++);
+            }
+        }
+
+        fclose(function_out);
+        fclose(form_out);
+        fclose(c.constants);
+    }
+
+    out = (output != NULL) ? fopen(output, "w") : stdout;
+    if (out == NULL) {
+        fprintf(stderr, "Could not open %s\n", output);
+        return false;
+    }
+
+    fprintf(out, "/* Compiled from %s by lersp --compile. */\n\n", source);
+    fprintf(out, "#include \"lersp.h\"\n\n");
+    fprintf(out, "static l_symbol sym[%d];\n", c.symbol_count + 1);
+    fprintf(out, "static l_builtin bif[%d];\n", c.builtin_count + 1);
+    fprintf(out, "static sexpr *lit[%d];\n\n", c.constant_count + 1);
+
+    for (count = 0, i = 0; i < program.count; i++) {
+        if (compiled[i] && is_function_definition(program.forms[i])) {
+            int arity = proper_length(program.forms[i]->cdr->cdr->car->cdr->car);
+            int j;
+
+            fprintf(out, "static sexpr *f%d(", i);
+            for (j = 0; j < arity; j++) {
+                fprintf(out, "%ssexpr *", (j > 0) ? ", " : "");
+            }
+            fprintf(out, "%s);\n", (arity > 0) ? "" : "void");
+
+            fprintf(out, "static sexpr *w%d(int argc, sexpr *argv[]) {\n", i);
+            fprintf(out, "    if (argc < %d) {\n"
+                    "        raise_error(\"Not enough arguments for function.\");\n"
+                    "    }\n", arity);
+            fprintf(out, "    return f%d(", i);
+            for (j = 0; j < arity; j++) {
+                fprintf(out, "%sargv[%d]", (j > 0) ? ", " : "", j);
+            }
+            fprintf(out, ");\n}\n\n");
+            count++;
+        }
+    }
+
+    fprintf(out, "static sexpr *setup(void) {\n");
+    for (name = 0; name < MAX_NAMES; name++) {
+        if (c.symbol_slot[name] >= 0) {
+            fprintf(out, "    sym[%d] = intern(", c.symbol_slot[name]);
+            write_c_string(out, lookup(name), strlen(lookup(name)));
+            fprintf(out, ");\n");
+        }
+        if (c.builtin_slot[name] >= 0) {
+            fprintf(out, "    bif[%d] = builtin_function(intern(", c.builtin_slot[name]);
+            write_c_string(out, lookup(name), strlen(lookup(name)));
+            fprintf(out, "));\n");
+        }
+    }
+    fputs(constants, out);
+    fprintf(out, "    return NIL;\n}\n\n");
+
+    fputs(functions, out);
+    fputs(forms, out);
+
+    fprintf(out, "int main(int argc, char *argv[]) {\n"
+            "    bool ok;\n\n"
+            "    gc_stack_bottom = __builtin_frame_address(0);\n"
+            "    start_compiled(argc, argv);\n"
+            "    ok = run_compiled(setup, false);\n");
+    for (i = 0; i < program.count; i++) {
+        fprintf(out, "    ok = run_compiled(form%d, true) && ok;\n", i);
+    }
+    fprintf(out, "    end_compiled();\n\n"
+            "    return ok ? 0 : 1;\n}\n");
+
+    free(functions);
+    free(forms);
+    free(constants);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    fprintf(stderr, "%s: compiled %d functions; %d forms in all.\n",
+            source, count, program.count);
+    return true;
+}
+
+/* The runtime for compiled programs; see lersp.h. */
+
+void start_compiled(int argc, char *argv[]) {
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    init();
+    file_argc = argc;
+    file_argv = argv;
+}
+
+bool run_compiled(sexpr *(*form)(void), bool show) {
+    int status;
+
+    if (show) {
+        out_str(";=> ");
+    }
+
+    status = setjmp(top_level_exception);
+    call_depth = 0;
+    if (status == NOT_EVALUATED) {
+        sexpr *value = form();
+        if (show) {
+            print(value);
+        }
+        return true;
+    }
+
+    fprintf(stderr, (status == SYNTAX_ERROR) ? "Syntax error.\n" : "Evaluation error.\n");
+    return false;
+}
+
+void end_compiled(void) {
+    out_str(";=> ");
+    flush_output();
+}
+
+l_symbol intern(const char *name) {
+    if (strlen(name) >= NAME_LENGTH) {
+        raise_error("Symbol name too long.");
+    }
+    return insert_symbol((char *) name);
+}
+
+sexpr *keep(sexpr *value) {
+    kept = cons(value, kept);
+    return value;
+}
+
+sexpr *read_constant(const char *text) {
+    FILE *in = fmemopen((void *) text, strlen(text), "r");
+    sexpr *value;
+
+    assert(in != NULL);
+    value = l_read_from(in);
+    fclose(in);
+    return keep(value);
+}
+
+l_builtin builtin_function(l_symbol symbol) {
+    size_t i;
+
+    for (i = 0; i < sizeof(BUILT_INS) / sizeof(BUILT_INS[0]); i++) {
+        if (BUILT_INS[i].identifier == symbol) {
+            return BUILT_INS[i].func;
+        }
+    }
+    assert(0);
+    return NULL;
+}
+
+sexpr *define_compiled(l_symbol name, l_builtin func, sexpr *lambda) {
+    sexpr *function;
+
+    function = eval(cons(slookup(LABEL), cons(slookup(name), cons(lambda, NIL))), NIL);
+    compiled_closures[function - heap] = func;
+    return function;
+}
+
+/* Binds name to a native function, as if it were a built-in. */
+static sexpr *bind_builtin(l_symbol name, l_builtin func, int arity) {
+    sexpr *function = new_cell();
+
+    function->type = BUILT_IN_FUNCTION;
+    function->func = func;
+    function->arity = arity;
+    /* Not a built-in that partially_evaluate() or the JIT know about. */
+    function->builtin_symbol = LAMBDA;
+    function->macro = false;
+
+    rebind_initial_symbol(slookup(name));
+    update_environment(&global, slookup(name), function);
+    return function;
+}
+
+int push_frame(l_symbol name) {
+    int frame = call_depth;
+    push_call(name);
+    return frame;
+}
+
+void pop_frame(int frame) {
+    call_depth = frame;
+}
+
+void raise_error(const char *message) {
+    fprintf(stderr, "%s\n", message);
+    longjmp(top_level_exception, EVAL_ERROR);
+}
+
+
+
+/*
+ * Embedding. See lersp.h.
+ */
+
+void start_embedded(void) {
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    init();
+}
+
+/*
+ * Runs body(data) with its own error handler, putting back whatever
+ * handler and call stack there were: the host may be calling in from a
+ * builtin it defined.
+ */
+static sexpr *protected_call(sexpr *(*body)(void *), void *data) {
+    sigjmp_buf outer;
+    int depth = call_depth;
+    sexpr *volatile result = NULL;
+    int status;
+
+    assert(gc_stack_bottom != NULL);
+
+    memcpy(outer, top_level_exception, sizeof(outer));
+    status = setjmp(top_level_exception);
+    if (status == NOT_EVALUATED) {
+        result = body(data);
+    } else if (status == SYNTAX_ERROR) {
+        /* Evaluation errors say what went wrong as they're raised; the
+         * reader leaves it to its caller. */
+        fprintf(stderr, "Syntax error.\n");
+    }
+    memcpy(top_level_exception, outer, sizeof(outer));
+    call_depth = depth;
+
+    return result;
+}
+
+static sexpr *eval_stream(void *in) {
+    sexpr *form, *result = NIL;
+
+    while ((form = l_read_from(in)) != EOF_OBJECT) {
+        result = eval(form, global);
+    }
+    return result;
+}
+
+sexpr *eval_text(const char *text, size_t length) {
+    FILE *in;
+    sexpr *result;
+
+    if (length == 0) {
+        return NIL;
+    }
+
+    in = fmemopen((void *) text, length, "r");
+    if (in == NULL) {
+        fprintf(stderr, "Could not read the text.\n");
+        return NULL;
+    }
+    result = protected_call(eval_stream, in);
+    fclose(in);
+
+    return result;
+}
+
+struct function_call {
+    const char *name;
+    int argc;
+    sexpr **argv;
+};
+
+static sexpr *call_by_name(void *data) {
+    struct function_call *call = data;
+    sexpr *func = assoc(intern(call->name), global), *args = NIL;
     int i;
-    sexpr *func;
 
-    int builtin_count = sizeof(BUILT_INS)/sizeof(struct builtin_func_def);
+    for (i = call->argc - 1; i >= 0; i--) {
+        args = cons(call->argv[i], args);
+    }
+    return apply(func, args);
+}
 
-    for (i = 0; i < builtin_count; i++) {
-        func = new_cell();
-        func->type = BUILT_IN_FUNCTION;
-        func->arity = BUILT_INS[i].arity;
-        func->func = BUILT_INS[i].func;;
+sexpr *call_function(const char *name, int argc, sexpr *argv[]) {
+    struct function_call call = { name, argc, argv };
+    return protected_call(call_by_name, &call);
+}
 
-        update_environment(&global, slookup(BUILT_INS[i].identifier), func);
+sexpr *define_builtin(const char *name, l_builtin func, int arity) {
+    /* There's no handler to raise to out here. */
+    if (strlen(name) >= NAME_LENGTH) {
+        fprintf(stderr, "Symbol name too long.\n");
+        return NULL;
     }
+    return bind_builtin(intern(name), func, arity);
+}
 
-    /* And also, T, which evaluates to itself. */
-    update_environment(&global, slookup(T), slookup(T));
+void release(sexpr *value) {
+    sexpr **link;
+
+    for (link = &kept; *link != NIL; link = &(*link)->cdr) {
+        if ((*link)->car == value) {
+            *link = (*link)->cdr;
+            return;
+        }
+    }
+}
 
+sexpr *new_string_value(const char *text, size_t length) {
+    sexpr *string = new_string(length);
+    memcpy(string_bytes(string), text, length);
+    return string;
 }
 
+const char *string_text(sexpr *string, size_t *length) {
+    assert((string != NIL) && (string->type == STRING));
+    *length = string_length_of(string);
+    return string_bytes(string);
+}
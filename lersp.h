@@ -1,37 +1,21 @@
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 
-#define HEAP_SIZE   2048
-#define MAX_NAMES   128
-#define NAME_LENGTH 8
-
-/* Define built-in symbols. */
-#define COND    0
-#define DEFINE  1
-#define LABEL   2 // Deprecate.
-#define LAMBDA  3
-#define QUOTE   4
-#define EVAL    5
-#define APPLY   6
-#define S_CONS  7
-#define CAR     8
-#define CDR     9
-#define EQ      10
-#define ATOM    11
-#define S_NULL  12
-#define NOT     13
-#define AND     14
-#define OR      15
-#define PLUS    16
-#define NEG     17
-#define DIV     18
-#define MUL     19
-#define LT      20
-#define GT      21
-#define F       22 // Deprecate
-#define T       23
-#define MAP     24
-#define REDUCE  25
-#define GC      26
+#ifndef HEAP_SIZE
+#define HEAP_SIZE   4096 /* Override with -DHEAP_SIZE=n to size the heap. */
+#endif
+#define MAX_NAMES   256
+#define NAME_LENGTH 16 /* Fills the cons cell's space exactly. */
+#define STRING_INLINE_LENGTH    15 /* Longer strings go in the string arena. */
+#define STRING_IN_ARENA         0xff
+
+/* Define built-in symbols: COND is 0, DEFINE 1, and so on. */
+enum initial_symbol {
+#define SYMBOL(id, name) id,
+#include "symbols.def"
+    INITIAL_SYMBOL_COUNT
+};
 
 /* setjmp exception return values. */
 #define NOT_PARSED      0 // Initial setjmp.
@@ -39,6 +23,7 @@
 #define SYNTAX_ERROR    1
 #define END_INPUT       2
 #define EVAL_ERROR      2
+#define LIMIT_EXCEEDED  3 // Out of fuel, cells or stack.
 
 
 typedef unsigned int    l_symbol;
@@ -53,16 +38,53 @@ enum sexpr_type {
     FUNCTION, /* Rename to: lambda. */
     BUILT_IN_FUNCTION,
     WORD, /* Deprecated. */
+    END_OF_FILE, /* One singleton value: #EOF */
+    PORT, /* A buffered stream s-expressions are read from or saved to. */
+    HASH_TABLE, /* Keys to values, stored outside of the heap. */
+    VECTOR, /* Items in a contiguous array outside of the heap. */
+    F64_ARRAY, /* Unboxed numbers in a contiguous array outside of the heap. */
+    STRING, /* Immutable bytes; short ones in the cell, long ones in an arena. */
+    CHANNEL, /* A queue of values passed between tasks, outside of the heap. */
 
     /* Unimplemented types: */
     BOOLEAN, /* Two singleton values: #T, #F. */
-    END_OF_FILE, /* One singleton value: #EOF */
-    STRING, 
 };
 
 typedef struct s_expression sexpr;
 typedef sexpr* (* l_builtin)(int, sexpr *[]);
 
+/* Open addressing; capacity is a power of two. */
+struct hash_slot {
+    uint64_t hash;
+    sexpr *key; /* NULL if never used. */
+    sexpr *value;
+};
+
+struct hash_table {
+    size_t capacity;
+    size_t count; /* Slots holding an entry. */
+    size_t used; /* Slots holding an entry or a deleted entry. */
+    struct hash_slot slots[];
+};
+
+struct vector {
+    size_t length;
+    sexpr *items[];
+};
+
+struct f64_array {
+    size_t length;
+    l_number items[];
+};
+
+struct task;
+
+struct channel {
+    size_t head, count, capacity;
+    sexpr **items; /* A ring of capacity values; count of them from head. */
+    struct task *waiting, *last_waiting; /* Blocked in RECEIVE, in order. */
+};
+
 /*
  * S-expressions represent all possible values in Lersp.
  *
@@ -73,6 +95,8 @@ typedef sexpr* (* l_builtin)(int, sexpr *[]);
  */
 struct s_expression {
     unsigned int reached : 2; // for Deutsch-Schor-Waite garbage collection
+    unsigned int printing : 1; // on the spine of a list display() has open
+    unsigned int macro : 1; // a function that expands calls instead
 
     enum sexpr_type type;
     union {
@@ -91,6 +115,34 @@ struct s_expression {
         struct {
             l_builtin func;
             int arity;
+            l_symbol builtin_symbol; /* The name it is initially bound to. */
+        };
+
+        /* Port; NULL once closed. */
+        FILE *stream;
+
+        /* Hash table; freed along with the cell. */
+        struct hash_table *table;
+
+        /* Vector; freed along with the cell. */
+        struct vector *vector;
+
+        /* Float64 array; freed along with the cell. */
+        struct f64_array *f64;
+
+        /* Channel; freed along with the cell. */
+        struct channel *channel;
+
+        /* Short string, or... */
+        struct {
+            char inline_text[STRING_INLINE_LENGTH];
+            unsigned char inline_length;
+        };
+
+        /* ...if inline_length is STRING_IN_ARENA, a long one. */
+        struct {
+            uint32_t string_offset; /* Into the string arena. */
+            uint32_t string_length;
         };
     };
 };
@@ -101,9 +153,17 @@ struct s_expression {
 /**
  * Reads an s-expression from stdin.
  * Calls longjpm on syntax error.
+ * Returns EOF_OBJECT once the input is exhausted.
  */
 sexpr *l_read(void);
 
+/**
+ * Reads exactly one s-expression from the given stream.
+ * Calls longjmp on syntax error.
+ * Returns EOF_OBJECT once the stream is exhausted.
+ */
+sexpr *l_read_from(FILE *stream);
+
 /**
  * { read -> eval -> print } loop
  */
@@ -132,6 +192,8 @@ sexpr* update_environment(sexpr **env, sexpr *symbol, sexpr *value);
 
 /**
  * Print an s-expression on stdout.
+ *
+ * Output is buffered; see flush_output().
  */
 void display(sexpr *);
 
@@ -140,6 +202,11 @@ void display(sexpr *);
  */
 void print(sexpr *);
 
+/**
+ * Writes out everything display() and print() have buffered so far.
+ */
+void flush_output(void);
+
 /**
  * Initialize the interpreter state.
  *
@@ -148,6 +215,19 @@ void print(sexpr *);
  */
 void init(void);
 
+/**
+ * Initialize the interpreter state from a heap image written by
+ * dump_image(), instead of calling init().
+ *
+ * Returns false if the image can't be read or came from another build.
+ */
+bool load_image(const char *path);
+
+/**
+ * Writes the entire interpreter state to a heap image.
+ */
+bool dump_image(const char *path);
+
 /**
  * Looks up the **name** for the given symbol.
  */
@@ -172,3 +252,129 @@ extern sexpr heap[];
  * Lisp Nil.
  */
 extern sexpr *const NIL;
+
+/**
+ * The end-of-file object, returned by the reader when input runs out.
+ */
+extern sexpr *const EOF_OBJECT;
+
+/**
+ * The highest address on the C stack the garbage collector will scan for
+ * live cells. Set this (in main) before evaluating anything.
+ */
+extern void *gc_stack_bottom;
+
+
+/*
+ * For programs translated to C by `lersp --compile`, linked against a
+ * build of lersp.c with -DLERSP_NO_MAIN.
+ */
+
+/**
+ * Initialize the interpreter for a compiled program. Any arguments are data
+ * files, as for the interpreter.
+ */
+void start_compiled(int argc, char *argv[]);
+
+/**
+ * Runs one top-level form; if show is set, prints its value as the REPL
+ * would. Returns false if it raised an error.
+ */
+bool run_compiled(sexpr *(*form)(void), bool show);
+
+/**
+ * Prints the final prompt and flushes output.
+ */
+void end_compiled(void);
+
+/**
+ * Returns the symbol with the given name, adding it if it's new. Raises an
+ * error if the name is NAME_LENGTH bytes or longer.
+ */
+l_symbol intern(const char *name);
+
+/**
+ * Reads an s-expression from text and keeps it alive for good.
+ */
+sexpr *read_constant(const char *text);
+
+/**
+ * Keeps value alive for good.
+ */
+sexpr *keep(sexpr *value);
+
+/**
+ * The built-in function initially bound to symbol.
+ */
+l_builtin builtin_function(l_symbol symbol);
+
+/**
+ * Binds name to the lambda expression, as LABEL would, but calling the
+ * closure runs the compiled function func instead.
+ */
+sexpr *define_compiled(l_symbol name, l_builtin func, sexpr *lambda);
+
+/**
+ * Enters a call to name on the Lisp call stack, returning the depth to go
+ * back to with pop_frame(). Raises if it's too deep.
+ */
+int push_frame(l_symbol name);
+void pop_frame(int frame);
+
+/**
+ * Prints message and abandons the top-level form.
+ */
+void raise_error(const char *message) __attribute__((noreturn));
+
+bool is_truthy(sexpr *value);
+sexpr *new_number(l_number number);
+
+
+/*
+ * Embedding: link against liblersp (`make lib`). There is one interpreter
+ * per process, and it isn't thread-safe.
+ *
+ * The collector finds the host's values the same way it finds its own:
+ * on the C stack, from gc_stack_bottom down -- so set it in main, as
+ * lersp's main does -- and in what keep() holds. Anything kept somewhere
+ * else must be kept, and released once it's no longer needed.
+ *
+ * Functions that evaluate return NULL if it raised an error; the message
+ * is on stderr. They can be called from within a builtin.
+ */
+
+/**
+ * Initialize the interpreter for a host program.
+ */
+void start_embedded(void);
+
+/**
+ * Reads and evaluates every s-expression in text; returns the value of the
+ * last one (NIL if there weren't any), or NULL.
+ */
+sexpr *eval_text(const char *text, size_t length);
+
+/**
+ * Calls the function bound to name with the given arguments; returns its
+ * value, or NULL.
+ */
+sexpr *call_function(const char *name, int argc, sexpr *argv[]);
+
+/**
+ * Binds name to a native function, alongside the built-ins. It's called
+ * with its arguments evaluated, and may raise_error(). Returns NULL if the
+ * name is too long to be a symbol.
+ */
+sexpr *define_builtin(const char *name, l_builtin func, int arity);
+
+/**
+ * Undoes keep().
+ */
+void release(sexpr *value);
+
+/**
+ * Strings. The bytes of a long string move when the collector compacts
+ * them: use them before allocating anything else.
+ */
+sexpr *new_string_value(const char *text, size_t length);
+const char *string_text(sexpr *string, size_t *length);
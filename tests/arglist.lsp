@@ -0,0 +1,11 @@
+; Argument lists are laid out in one piece before the arguments are
+; evaluated; collections while they're being filled in must keep both
+; the list and the values already in it.
+(label build (lambda (n acc) (cond ((eq n 0) acc) (t (build (- n 1) (cons n acc))))))
+(label len (lambda (l n) (cond ((null l) n) (t (len (cdr l) (+ n 1))))))
+(label lens (lambda (a b c d e f)
+  (cons (len a 0) (cons (len b 0) (cons (len c 0)
+    (cons (len d 0) (cons (len e 0) (cons (len f 0) ()))))))))
+(lens (build 250 ()) (build 250 ()) (build 250 ()) (build 250 ()) (build 250 ()) (build 250 ()))
+(lens (build 1 ()) () (build 2 ()) () (build 3 ()) ())
+(lens 1 2)
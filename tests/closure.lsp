@@ -0,0 +1,20 @@
+; Closures capture the local bindings their bodies use -- from however
+; far out -- and nothing else; globals are looked up when called, so
+; mutually recursive LABELs work. A closure prints builtins folded into
+; it by address, so ADD2 is only checked to be an atom.
+(label adder (lambda (n) (lambda (x) (+ x n))))
+(atom (label add2 (adder 2)))
+(add2 40)
+(label outer (lambda (a b) (lambda (c) (lambda (d) (+ a (+ c d))))))
+(((outer 100 (quote unused)) 20) 3)
+(label shadow (lambda (x) (lambda (x) (* x 2))))
+((shadow 1) 21)
+(label quoted (lambda (x) (lambda (y) (quote (x y)))))
+((quoted 1) 2)
+(label evens (lambda (n) (cond ((eq n 0) t) (t (odds (- n 1))))))
+(label odds (lambda (n) (cond ((eq n 0) f) (t (evens (- n 1))))))
+(evens 10)
+(odds 7)
+(gc)
+(add2 1)
+(((lambda (x) (lambda (y) (+ x z))) 1) 2)
@@ -0,0 +1,26 @@
+# --compile: the program translated to C, built and run, prints what the
+# interpreter does -- errors included.
+
+cat > "$SCRATCH/prog.lsp" <<'PROGRAM'
+(label fact (lambda (n) (cond ((eq n 0) 1) (t (* n (fact (- n 1)))))))
+(label compose (lambda (f g) (lambda (x) (f (g x)))))
+(label twice (lambda (x) (* x 2)))
+(fact 10)
+((compose twice fact) 5)
+(label pairs (lambda (l) (cond ((null l) ()) (t (cons (cons (car l) (car l)) (pairs (cdr l)))))))
+(pairs (quote (a b c)))
+fact
+(car (quote x))
+(fact 5)
+PROGRAM
+
+(cd "$SCRATCH" && "$LERSP" --compile prog.lsp -o prog.c) || exit 1
+${CC:-cc} -I.. -DLERSP_NO_MAIN -o "$SCRATCH/prog" "$SCRATCH/prog.c" \
+    ../lersp.c -lm -pthread || exit 1
+
+"$SCRATCH/prog" > "$SCRATCH/compiled" 2> "$SCRATCH/compiled.err"
+"$LERSP" < "$SCRATCH/prog.lsp" 2> "$SCRATCH/interpreted.err" \
+    | sed '1,4{/^; /d;/^$/d}' > "$SCRATCH/interpreted"
+diff "$SCRATCH/interpreted" "$SCRATCH/compiled" \
+    && diff "$SCRATCH/interpreted.err" "$SCRATCH/compiled.err" \
+    && cat "$SCRATCH/compiled" && cat "$SCRATCH/compiled.err" >&2
@@ -0,0 +1,80 @@
+# The embedding API: a host defines builtins, evaluates text, calls Lisp
+# functions -- from inside a builtin, too -- and keeps values across a
+# collection; errors come back as NULL with a message on stderr.
+
+cat > "$SCRATCH/host.c" <<'HOST'
+#include <stdio.h>
+#include <string.h>
+
+#include "lersp.h"
+
+static sexpr *twice(int n, sexpr *argv[]) {
+    if ((argv[0] == NIL) || (argv[0]->type != NUMBER)) {
+        raise_error("twice takes a number.");
+    }
+    return new_number(argv[0]->number * 2);
+}
+
+/* Calls back into Lisp. */
+static sexpr *inc_twice(int n, sexpr *argv[]) {
+    sexpr *once = call_function("INC", 1, argv);
+    return (once != NULL) ? call_function("INC", 1, (sexpr *[]) { once }) : NIL;
+}
+
+static void show(const char *what, sexpr *value) {
+    size_t length;
+    const char *text;
+
+    if (value == NULL) {
+        printf("%s: NULL\n", what);
+    } else if (value == NIL) {
+        printf("%s: NIL\n", what);
+    } else if (value->type == NUMBER) {
+        printf("%s: %g\n", what, value->number);
+    } else if (value->type == STRING) {
+        text = string_text(value, &length);
+        printf("%s: \"%.*s\"\n", what, (int) length, text);
+    } else {
+        printf("%s: something else\n", what);
+    }
+    fflush(stdout);
+}
+
+static sexpr *eval_string(const char *text) {
+    return eval_text(text, strlen(text));
+}
+
+int main(void) {
+    sexpr *kept;
+
+    gc_stack_bottom = __builtin_frame_address(0);
+    start_embedded();
+    define_builtin("TWICE", twice, 1);
+    define_builtin("INC-TWICE", inc_twice, 1);
+
+    show("eval_text", eval_string("(label inc (lambda (x) (+ x 1))) (twice (inc 20))"));
+    show("call_function", call_function("INC", 1, (sexpr *[]) { new_number(41) }));
+    show("builtin calling Lisp", eval_string("(inc-twice 40)"));
+    show("empty text", eval_string(""));
+
+    kept = keep(new_string_value("a string long enough for the arena", 34));
+    eval_string("(label garbage (string-append \"more than fifteen bytes\" \"!\"))");
+    eval_string("(label garbage ())");
+    eval_string("(gc)");
+    show("kept", kept);
+    release(kept);
+
+    show("raise_error", eval_string("(twice (quote x))"));
+    show("evaluation error", eval_string("(car 1)"));
+    show("syntax error", eval_string("(inc 1"));
+    show("undefined function", call_function("NO-SUCH", 0, NULL));
+    show("long name", call_function("A-NAME-TOO-LONG-FOR-A-SYMBOL", 0, NULL));
+    show("long builtin", define_builtin("A-NAME-TOO-LONG-FOR-A-SYMBOL", twice, 1));
+    show("after errors", eval_string("(inc 2)"));
+    return 0;
+}
+HOST
+
+${CC:-cc} -I.. -DLERSP_NO_MAIN -o "$SCRATCH/host" "$SCRATCH/host.c" \
+    ../lersp.c -lm -pthread || exit 1
+"$SCRATCH/host"
@@ -0,0 +1,25 @@
+; Unboxed float64 arrays: conversion both ways, the element-wise and
+; reducing kernels (over lengths that aren't a multiple of the vector
+; width), and mismatched lengths and bad indexes.
+(label a (list->f64 (quote (1 2 3 4 5 6 7))))
+(label b (list->f64 (quote (7 6 5 4 3 2 1))))
+(f64-length a)
+(f64->list (f64+ a b))
+(f64->list (f64- a b))
+(f64->list (f64* a b))
+(f64->list (f64/ a b))
+(f64->list (f64-scale a 0.5))
+(f64-dot a b)
+(f64-sum a)
+(f64-min b)
+(f64-max b)
+(label z (make-f64 3))
+(f64-set! z 1 2.5)
+(f64->list z)
+(f64-ref z 1)
+(f64-ref z 3)
+(f64-set! z 0 (quote x))
+(f64+ a z)
+(f64-sum (quote (1 2)))
+(list->f64 (quote (1 x)))
+(f64-min (make-f64 0))
@@ -0,0 +1,17 @@
+; args: $SCRATCH/saved.fasl corrupt.fasl ports.data
+; SAVE and LOAD-BINARY round trip; a truncated file and one that isn't
+; FASL at all are refused, and so are functions.
+(atom (label o (open-output 1)))
+(label x (quote (shared 1.5 -2)))
+(save o (cons x (cons x (quote (a (b . c) ())))))
+(close o)
+(atom (label i (open-input 1)))
+(load-binary i)
+(eof? (read i))
+(load-binary (open-input 2))
+(load-binary (open-input 3))
+(atom (label bad (open-input 3)))
+(load-binary bad)
+(read bad)
+(load-binary (quote port))
+(save (open-output 1) (lambda (x) x))
@@ -0,0 +1,25 @@
+; Lambda bodies are partially evaluated when first created: constant
+; calls fold, constant COND tests prune, but nothing that could raise is
+; folded, and rebinding a builtin's name undoes what was folded with it.
+(label f (lambda (x) (+ x (* 6 7))))
+(f 0)
+(label g (lambda (x) (cond ((eq 1 2) (quote no)) ((< 1 2) (+ x 1)) (t (quote never)))))
+(g 1)
+(label h (lambda () (car (quote (a b)))))
+(h)
+(label raises (lambda () (car 1)))
+(quote created)
+(raises)
+(gc)
+(f 1)
+(g 2)
+(label twice (lambda (x) (* x 2)))
+(label k (lambda (x) (twice (+ 1 2))))
+(k 0)
+(label twice (lambda (x) (* x 3)))
+(k 0)
+(label m (lambda (x) (car x)))
+(m (quote (1 2)))
+(atom (label car cdr))
+(m (quote (1 2)))
+(h)
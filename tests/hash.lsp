@@ -0,0 +1,26 @@
+; Hash tables: keys of every hashable type, deletion, growing well past
+; the initial size through a few collections, and the errors.
+(label h (make-hash))
+(hash-put h (quote a) 1)
+(hash-put h 2 (quote two))
+(hash-put h "s" 3)
+(hash-get h (quote a))
+(hash-get h 2)
+(hash-get h "s")
+(hash-get h (quote missing))
+(hash-count h)
+(hash-del h (quote a))
+(hash-get h (quote a))
+(hash-count h)
+(hash-keys h)
+(label fill (lambda (n)
+  (cond ((eq n 0) (hash-count h))
+        ((atom (hash-put h n (* n n))) (fill (- n 1))))))
+(fill 1000)
+(hash-get h 2)
+(hash-get h 999)
+(gc)
+(hash-get h 500)
+(hash-put h (quote (a list)) 1)
+(hash-get (quote not-a-table) 1)
+(hash-put h 1)
@@ -0,0 +1,26 @@
+; args: -u
+; With -u, equal data read in is shared; it must still read back as
+; written, EQUAL must see through the sharing, and macro expansion must
+; not rewrite a shared form.
+(label a (quote (1 (2 3) "s" (2 3))))
+(label b (quote (1 (2 3) "s" (2 3))))
+(equal a b)
+(equal (car (cdr a)) (car (cdr (cdr (cdr b)))))
+(equal a (quote (1 (2 3) "s" (2 4))))
+(equal (quote (x . y)) (quote (x . y)))
+(equal (quote (x)) (quote x))
+(equal 1.5 1.5)
+(equal "s" "s")
+(defmacro twice (x) (cons (quote +) (cons x (cons x ()))))
+(label form (quote (twice 21)))
+(label same (quote (twice 21)))
+(eval form)
+form
+same
+(label inc (lambda (x) (twice x)))
+(label shared-body (lambda (x) (twice x)))
+(inc 1)
+(shared-body 2)
+(gc)
+a
+(equal a b)
@@ -0,0 +1,13 @@
+# Heap images: what one session defines, another starts with. Starting
+# from an image leaves out the banner; a fresh session, flags or not,
+# prints it.
+
+echo '(label double (lambda (x) (+ x x)))' \
+    | "$LERSP" -d "$SCRATCH/image" > /dev/null
+echo '(double 21)' | "$LERSP" -i "$SCRATCH/image"
+echo
+echo '(+ 1 2)' | "$LERSP" -u | head -n 1
+
+# Not an image at all.
+"$LERSP" -i images.sh < /dev/null
+echo "exit status $?"
@@ -0,0 +1,25 @@
+; Hot numeric lambdas are compiled; each guard must hand the calls it
+; can't take back to the interpreter, with the same answers and errors.
+; ADD5 prints builtins folded into it by address, so it isn't printed.
+(label fib (lambda (n) (cond ((< n 2) n) (t (+ (fib (- n 1)) (fib (- n 2)))))))
+(fib 20)
+(fib (quote x))
+(fib 1.5)
+(label slow-fib fib)
+(label fib (lambda (n) (quote redefined)))
+(slow-fib 10)
+(label loop (lambda (n acc) (cond ((eq n 0) acc) (t (loop (- n 1) (+ acc n))))))
+(loop 100000 0)
+(label deep (lambda (n) (cond ((eq n 0) 0) (t (+ 1 (deep (- n 1)))))))
+(deep 100)
+(deep 100000)
+(deep 200)
+(label scale 3)
+(label scaled (lambda (n) (cond ((< n 1) 0) (t (+ scale (scaled (- n 1)))))))
+(scaled 100)
+(label scale 4)
+(scaled 100)
+(label mk (lambda (k) (lambda (n) (cond ((< n 1) 0) (t (+ k n))))))
+(atom (label add5 (mk 5)))
+(label sum5 (lambda (n acc) (cond ((eq n 0) acc) (t (sum5 (- n 1) (+ acc (add5 n)))))))
+(sum5 100 0)
@@ -0,0 +1,26 @@
+; DEFMACRO, each call site expanded once, however often it runs; the
+; built-in macros, rest arguments, and EVAL leaving the form it was
+; given alone.
+(label expansions (make-hash))
+(hash-put expansions (quote n) 0)
+(label seq (lambda (first then) then))
+(defmacro unless (test form)
+  (seq (hash-put expansions (quote n) (+ 1 (hash-get expansions (quote n))))
+       (cons (quote cond) (cons (cons test (quote ((quote skipped))))
+                                (cons (cons (quote t) (cons form ())) ())))))
+(label countdown (lambda (n) (unless (eq n 0) (countdown (- n 1)))))
+(countdown 5)
+(countdown 10)
+(hash-get expansions (quote n))
+(defmacro first-of (first . rest) first)
+(first-of (quote a) (car 1) (car 2))
+(let ((x 2) (y 3)) (* x y))
+(and t (eq 1 1) (quote yes))
+(or (eq 1 2) (eq 2 2))
+(label form (quote (unless (eq 1 2) (quote ran))))
+(eval form)
+form
+(eval form)
+(hash-get expansions (quote n))
+(first-of)
+(unless t)
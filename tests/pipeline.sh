@@ -0,0 +1,17 @@
+# -b reads, evaluates and prints on separate threads; the output must be
+# the same as without it, errors and all.
+
+for program in closure.lsp hash.lsp macro.lsp string.lsp; do
+    "$LERSP" < "$program" > "$SCRATCH/plain" 2> "$SCRATCH/plain.err"
+    "$LERSP" -b < "$program" > "$SCRATCH/piped" 2> "$SCRATCH/piped.err"
+    if cmp -s "$SCRATCH/plain" "$SCRATCH/piped" \
+            && cmp -s "$SCRATCH/plain.err" "$SCRATCH/piped.err"; then
+        echo "$program: same"
+    else
+        echo "$program: different"
+    fi
+done
+
+# A syntax error mid-stream, and input that ends mid-expression.
+printf '(car (quote (a)))\n)\n(cdr (quote (a b)))\n(car\n' | "$LERSP" -b
+echo
@@ -0,0 +1,20 @@
+; args: ports.data
+; Ports opened by command line argument and by name, READ taking one
+; expression at a time off them, and the ways opening and reading fail.
+; Ports print their address, so these only check that they're atoms.
+(atom (label p (open-input 1)))
+(read p)
+(read p)
+(read p)
+(eof? (read p))
+(eof? (read p))
+(close p)
+(read p)
+(atom (label q (open-input "ports.data")))
+(read q)
+(close q)
+(open-input 2)
+(open-input "no-such-file")
+(open-input "")
+(open-input (quote ports))
+(read (quote ports))
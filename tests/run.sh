@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Runs every test in this directory, from this directory. A test is
+# either NAME.lsp, a program fed to lersp on stdin, or NAME.sh, a script
+# run with $LERSP set. What it prints must match NAME.out, and what it
+# reports on stderr NAME.err (or nothing, if there's no such file).
+#
+# A "; args:" line in a program gives lersp's command line. $SCRATCH, in
+# it or in a script's environment, is a directory to write files to.
+#
+# Usage: tests/run.sh [path/to/lersp]
+
+LERSP=$(cd "$(dirname "${1:-./lersp}")" && pwd)/$(basename "${1:-./lersp}")
+SCRATCH=$(mktemp -d)
+STATUS=0
+export LERSP SCRATCH
+
+cd "$(dirname "$0")" || exit 2
+
+for test in *.lsp *.sh; do
+    name=${test%.*}
+    case "$test" in
+        run.sh|\**) continue ;;
+        *.lsp)
+            args=$(sed -n 's/^; args: //p' "$test")
+            # The banner isn't what's being tested.
+            eval "\"\$LERSP\" $args" < "$test" 2> "$SCRATCH/err" \
+                | sed '1,4{/^; /d;/^$/d}' > "$SCRATCH/out"
+            ;;
+        *.sh)
+            sh "$test" > "$SCRATCH/out" 2> "$SCRATCH/err"
+            ;;
+    esac
+
+    expected_err=/dev/null
+    if [ -f "$name.err" ]; then
+        expected_err=$name.err
+    fi
+
+    if cmp -s "$SCRATCH/out" "$name.out" \
+            && cmp -s "$SCRATCH/err" "$expected_err"; then
+        echo "ok   $test"
+    else
+        echo "FAIL $test"
+        diff "$name.out" "$SCRATCH/out"
+        diff "$expected_err" "$SCRATCH/err"
+        STATUS=1
+    fi
+done
+
+rm -rf "$SCRATCH"
+exit $STATUS
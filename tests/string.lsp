@@ -0,0 +1,25 @@
+; Strings, short ones kept in the cell and long ones in the arena --
+; which a collection compacts -- and substrings out of range.
+(label short "short")
+(label long (string-append "a string too long to fit" " in a cell"))
+(string-length short)
+(string-length long)
+(substring long 2 8)
+(substring long 0 (string-length long))
+(string=? (substring long 0 1) "a")
+(string<? short long)
+(string<? long short)
+(string->symbol "sym")
+(symbol->string (quote sym))
+(string-append)
+(string-append "" "")
+(label garbage (string-append long long long))
+(label garbage ())
+(gc)
+long
+(string-append long "!")
+(substring short 3 2)
+(substring short 0 6)
+(substring short (- 0 1) 2)
+(string-length (quote short))
+(string-append short 1)
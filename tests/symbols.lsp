@@ -0,0 +1,18 @@
+; The initial symbols come from a generated perfect hash: names read in
+; any case find their builtin, near misses don't, and new symbols are
+; told apart from the initial ones.
+(Car (quote (a b)))
+(HASH-COUNT (make-hash))
+(f64-sum (list->f64 (quote (1 2))))
+(string-length (symbol->string (quote make-channel)))
+(eq (quote lambda) (quote LAMBDA))
+(eq (quote cars) (quote car))
+(eq (string->symbol "CAR") (quote car))
+(atom (quote vector-set!))
+(symbol->string (quote vector-ref))
+(cars (quote (a b)))
+(ca (quote (a b)))
+(hash-ge (make-hash) 1)
+(label cars (lambda (l) (car (car l))))
+(cars (quote ((a) b)))
+(car (quote (a b)))
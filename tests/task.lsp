@@ -0,0 +1,27 @@
+; Tasks and channels: results, taking turns, a failed task raising in
+; whoever receives from it, the depth limit in a task, deadlock, and
+; enough tasks at once to need the collector and reuse finished stacks.
+(receive (spawn (lambda (x y) (+ x y)) 40 2))
+(label log (make-channel))
+(label say (lambda (word n)
+  (cond ((eq n 0) (send log word))
+        ((atom (send log word)) (say (seq (yield) word) (- n 1))))))
+(label seq (lambda (first then) then))
+(label drain (lambda (c n acc) (cond ((eq n 0) acc) (t (drain c (- n 1) (cons (receive c) acc))))))
+(atom (spawn say (quote ping) 2))
+(atom (spawn say (quote pong) 2))
+(drain log 6 ())
+(receive (spawn (lambda () ())))
+(receive (spawn (lambda (x) (car x)) 5))
+(receive (spawn (lambda () (receive (spawn (lambda () (car 1)))))))
+(label deep (lambda (n) (cond ((eq n 0) 0) (t (+ 1 (deep (- n 1)))))))
+(receive (spawn deep 500))
+(receive (spawn deep 5000))
+(receive (make-channel))
+(label many (lambda (n c) (cond ((eq n 0) c) (t (many (- n 1) (seq (spawn (lambda (k) (send c (* k k))) n) c))))))
+(label sum (lambda (c n acc) (cond ((eq n 0) acc) (t (sum c (- n 1) (+ acc (receive c)))))))
+(sum (many 300 (make-channel)) 300 0)
+(sum (many 300 (make-channel)) 300 0)
+(yield)
+(send 1 2)
+(spawn 1)
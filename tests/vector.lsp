@@ -0,0 +1,18 @@
+; Vectors: fixed length, O(1) indexing, holding anything -- even
+; themselves -- through a collection; and the ways indexing fails.
+(label v (make-vector 3))
+(vector-length v)
+(vector-ref v 0)
+(vector-set! v 0 (quote a))
+(vector-set! v 1 (quote (b c)))
+(vector-set! v 2 v)
+(vector-ref v 1)
+(eq (vector-ref (vector-ref v 2) 0) (quote a))
+(gc)
+(vector-ref v 1)
+(vector-length (make-vector 0))
+(vector-ref v 3)
+(vector-ref v (- 0 1))
+(vector-set! v 1.5 1)
+(vector-ref (quote v) 0)
+(make-vector (- 0 1))